@@ -0,0 +1,508 @@
+/*
+    (c) Tom Robbins 2012
+
+*/
+
+#include "distributed.h"
+
+/*
+A worker's exchanges around the ring, done by one thread which lives as long
+as the worker. pending is set (under lock) to ask for outgoing to be sent on
+and incoming to be filled, and cleared when that is done; changed is
+signalled both ways.
+*/
+typedef struct {
+    transport * t;
+    double * outgoing;
+    double * incoming;
+    size_t bytes;
+    int pending;
+    int quit;
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} ring_exchange;
+
+static int unix_socket_send(transport * t, int peer, void * data, size_t bytes){
+    int fd = ((int *)t->state)[peer];
+    char * p = data;
+    while(bytes > 0){
+        // a peer which has gone away gives an error here rather than SIGPIPE
+        ssize_t sent = send(fd, p, bytes, MSG_NOSIGNAL);
+        if(sent < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        p += sent;
+        bytes -= sent;
+    }
+    return 0;
+}
+
+static int unix_socket_recv(transport * t, int peer, void * data, size_t bytes){
+    int fd = ((int *)t->state)[peer];
+    char * p = data;
+    while(bytes > 0){
+        ssize_t got = read(fd, p, bytes);
+        if(got < 0 && errno == EINTR){
+            continue;
+        }
+        if(got <= 0){
+            return -1;
+        }
+        p += got;
+        bytes -= got;
+    }
+    return 0;
+}
+
+static void unix_socket_close(transport * t){
+    int i, count = t->rank == t->size ? t->size : 3;
+    for(i=0;i<count;i++){
+        if(((int *)t->state)[i] >= 0){
+            close(((int *)t->state)[i]);
+        }
+    }
+    arena_free(t->state);
+    t->state = NULL;
+}
+
+transport * unix_socket_transports(int worker_count){
+    /*
+    Makes a transport for each worker (0 to worker_count - 1) and one for the
+    writer (worker_count), connected by Unix socket pairs: one between each
+    worker and the next (in a ring) and one between each worker and the
+    writer. Call this before forking, then attach_unix_socket_transport() in
+    each process. Returns NULL if the sockets can't be made.
+    */
+    transport * transports = arena_malloc(sizeof(transport) * (worker_count + 1));
+    int i, pair[2];
+    for(i=0;i<=worker_count;i++){
+        transports[i].rank = i;
+        transports[i].size = worker_count;
+        transports[i].send = &unix_socket_send;
+        transports[i].recv = &unix_socket_recv;
+        transports[i].close = &unix_socket_close;
+        int fd_count = i == worker_count ? worker_count : 3;
+        transports[i].state = arena_malloc(sizeof(int) * fd_count);
+        memset(transports[i].state, -1, sizeof(int) * fd_count);
+    }
+
+    for(i=0;i<worker_count;i++){
+        if(worker_count > 1){
+            if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0){
+                break;
+            }
+            ((int *)transports[i].state)[PEER_NEXT] = pair[0];
+            ((int *)transports[(i + 1) % worker_count].state)[PEER_PREVIOUS] = pair[1];
+        }
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0){
+            break;
+        }
+        ((int *)transports[i].state)[PEER_WRITER] = pair[0];
+        ((int *)transports[worker_count].state)[i] = pair[1];
+    }
+
+    if(i < worker_count){
+        for(i=0;i<=worker_count;i++){
+            transports[i].close(&(transports[i]));
+        }
+        arena_free(transports);
+        return NULL;
+    }
+    return transports;
+}
+
+transport * attach_unix_socket_transport(transport * transports, int rank){
+    // closes the sockets belonging to every other process and returns this
+    // process' transport.
+    int i, size = transports[0].size;
+    for(i=0;i<=size;i++){
+        if(i != rank){
+            transports[i].close(&(transports[i]));
+        }
+    }
+    return &(transports[rank]);
+}
+
+static int exchange_block(ring_exchange * exchange){
+    // passes a block on around the ring. Even workers send first and odd ones
+    // receive first, so that the ring can not deadlock when blocks are bigger
+    // than the socket buffers. Returns 0 on success.
+    transport * t = exchange->t;
+    if(t->rank % 2 == 0){
+        return t->send(t, PEER_NEXT, exchange->outgoing, exchange->bytes) != 0
+            || t->recv(t, PEER_PREVIOUS, exchange->incoming, exchange->bytes) != 0;
+    }
+    return t->recv(t, PEER_PREVIOUS, exchange->incoming, exchange->bytes) != 0
+        || t->send(t, PEER_NEXT, exchange->outgoing, exchange->bytes) != 0;
+}
+
+static void * exchange_thread(void * arg){
+    // does each exchange asked for by start_exchange() until told to quit
+    ring_exchange * exchange = arg;
+    pthread_mutex_lock(&(exchange->lock));
+    while(1){
+        while(!exchange->pending && !exchange->quit){
+            pthread_cond_wait(&(exchange->changed), &(exchange->lock));
+        }
+        if(!exchange->pending){
+            break;
+        }
+        pthread_mutex_unlock(&(exchange->lock));
+        int failed = exchange_block(exchange);
+        pthread_mutex_lock(&(exchange->lock));
+        exchange->failed |= failed;
+        exchange->pending = 0;
+        pthread_cond_broadcast(&(exchange->changed));
+    }
+    pthread_mutex_unlock(&(exchange->lock));
+    return NULL;
+}
+
+static void start_exchange(ring_exchange * exchange, double * outgoing, double * incoming){
+    pthread_mutex_lock(&(exchange->lock));
+    exchange->outgoing = outgoing;
+    exchange->incoming = incoming;
+    exchange->pending = 1;
+    pthread_cond_broadcast(&(exchange->changed));
+    pthread_mutex_unlock(&(exchange->lock));
+}
+
+static int finish_exchange(ring_exchange * exchange){
+    // waits for the exchange from start_exchange(). Returns 0 on success.
+    pthread_mutex_lock(&(exchange->lock));
+    while(exchange->pending){
+        pthread_cond_wait(&(exchange->changed), &(exchange->lock));
+    }
+    int failed = exchange->failed;
+    pthread_mutex_unlock(&(exchange->lock));
+    return failed;
+}
+
+static void accumulate_block(double * block, double * positions, double * masses, int first, int count, double * acceleration){
+    // adds the pull of the bodies in block (laid out as start index, count,
+    // then x, y, z for each) on bodies first to first + count - 1. Done the
+    // same way as free_3d_orbit_functions(), but as the blocks come in ring
+    // order the sums are rounded differently.
+    int start = (int)block[0], block_count = (int)block[1];
+    int b, j, c;
+    for(b=0;b<count;b++){
+        for(j=0;j<block_count;j++){
+            if(start + j == first + b){
+                continue;
+            }
+            double diff[3];
+            for(c=0;c<3;c++){
+                diff[c] = positions[b * 6 + c] - block[2 + j * 3 + c];
+            }
+            double distance_cubed = pow(pow(diff[0], 2) + pow(diff[1], 2) + pow(diff[2], 2), 1.5);
+            for(c=0;c<3;c++){
+                // check for collision
+                if(fabs(diff[c]) <= DBL_EPSILON){
+                    continue;
+                }
+                acceleration[b * 3 + c] -= GRAVITATIONAL_CONSTANT * masses[start + j] * diff[c] / distance_cubed;
+            }
+        }
+    }
+}
+
+static int ring_derivatives(ring_exchange * exchange, double * stage, double * masses, int first, int count, double ** blocks, double * sums, double * rates){
+    /*
+    rates for this worker's bodies (6 each: velocity then acceleration). Every
+    worker's positions go once around the ring; while one block is in flight,
+    the pull of the block already here is worked out. Returns 0 on success, or
+    1 if a block could not be passed on (ie, a neighbour has died).
+    */
+    transport * t = exchange->t;
+    int b, c, s;
+    double * current = blocks[0], * incoming = blocks[1];
+    current[0] = first;
+    current[1] = count;
+    for(b=0;b<count;b++){
+        for(c=0;c<3;c++){
+            current[2 + b * 3 + c] = stage[b * 6 + c];
+        }
+    }
+
+    for(b=0;b<count * 3;b++){
+        sums[b] = 0;
+    }
+    for(s=0;s<t->size;s++){
+        if(s + 1 < t->size){
+            start_exchange(exchange, current, incoming);
+        }
+        accumulate_block(current, stage, masses, first, count, sums);
+        if(s + 1 < t->size){
+            if(finish_exchange(exchange) != 0){
+                return 1;
+            }
+            double * swap = current;
+            current = incoming;
+            incoming = swap;
+        }
+    }
+    for(b=0;b<count;b++){
+        for(c=0;c<3;c++){
+            rates[b * 6 + c] = stage[b * 6 + 3 + c];
+            rates[b * 6 + 3 + c] = sums[b * 3 + c];
+        }
+    }
+    return 0;
+}
+
+static int distributed_worker(transport * t, double * starting_values, double step){
+    // integrates this worker's share of the bodies with 4th order Runge-Kutta,
+    // sending each state to the writer. Returns 0 on success, or 1 if contact
+    // with another process is lost.
+    int n = body_count, first = t->rank * n / t->size, count = (t->rank + 1) * n / t->size - first;
+    int block_size = 2 + 3 * ((n + t->size - 1) / t->size);
+    int b, c, i, j;
+    double time = starting_values[0], time_limit = starting_values[7 * n + 1];
+
+    double * masses = arena_malloc(sizeof(double) * n);
+    for(b=0;b<n;b++){
+        masses[b] = starting_values[b * 7 + 7];
+    }
+    double * y = arena_malloc(sizeof(double) * count * 6);
+    double * temp = arena_malloc(sizeof(double) * count * 6);
+    double * k[4];
+    for(i=0;i<4;i++){
+        k[i] = arena_malloc(sizeof(double) * count * 6);
+    }
+    double * blocks[] = {arena_malloc(sizeof(double) * block_size), arena_malloc(sizeof(double) * block_size)};
+    double * message = arena_malloc(sizeof(double) * (2 + 7 * count));
+    double * sums = arena_malloc(sizeof(double) * count * 3);
+
+    ring_exchange exchange = {.t = t, .bytes = sizeof(double) * block_size};
+    pthread_t exchanger;
+    pthread_mutex_init(&(exchange.lock), NULL);
+    pthread_cond_init(&(exchange.changed), NULL);
+    if(t->size > 1){
+        pthread_create(&exchanger, NULL, &exchange_thread, &exchange);
+    }
+
+    for(b=0;b<count;b++){
+        for(c=0;c<6;c++){
+            y[b * 6 + c] = starting_values[(first + b) * 7 + 1 + c];
+        }
+    }
+
+    #ifdef COUNT_ALLOCATIONS
+    long allocations_after_first_step = -1;
+    #endif
+
+    int status = CONTINUE_ITERATING, result = 0;
+    while(1){
+        // time, status, then 7 values for each body
+        message[0] = time;
+        message[1] = status;
+        for(b=0;b<count;b++){
+            for(c=0;c<6;c++){
+                message[2 + b * 7 + c] = y[b * 6 + c];
+            }
+            message[2 + b * 7 + 6] = masses[first + b];
+        }
+        if(t->send(t, PEER_WRITER, message, sizeof(double) * (2 + 7 * count)) != 0){
+            result = 1;
+            break;
+        }
+        if(status == STOP_ITERATING){
+            break;
+        }
+
+        // shorten the last step to end on the time limit
+        double h = time + step > time_limit ? time_limit - time : step;
+        double half[] = {h / 2, h / 2, h};
+        result = ring_derivatives(&exchange, y, masses, first, count, blocks, sums, k[0]);
+        for(i=1;i<4 && result == 0;i++){
+            for(j=0;j<count * 6;j++){
+                temp[j] = y[j] + half[i - 1] * k[i - 1][j];
+            }
+            result = ring_derivatives(&exchange, temp, masses, first, count, blocks, sums, k[i]);
+        }
+        if(result != 0){
+            break;
+        }
+        for(j=0;j<count * 6;j++){
+            y[j] = y[j] + h/6*(k[0][j] + 2*k[1][j] + 2*k[2][j] + k[3][j]);
+        }
+        time = time + h;
+        if(time >= time_limit - fabs(h) * 1E-9){
+            time = time_limit;
+            status = STOP_ITERATING;
+        }
+        #ifdef COUNT_ALLOCATIONS
+        if(allocations_after_first_step < 0){
+            allocations_after_first_step = allocation_count;
+        }
+        #endif
+    }
+
+    #ifdef COUNT_ALLOCATIONS
+    check_allocations("a --distributed worker", allocations_after_first_step);
+    #endif
+    if(t->size > 1){
+        pthread_mutex_lock(&(exchange.lock));
+        exchange.quit = 1;
+        pthread_cond_broadcast(&(exchange.changed));
+        pthread_mutex_unlock(&(exchange.lock));
+        pthread_join(exchanger, NULL);
+    }
+    pthread_mutex_destroy(&(exchange.lock));
+    pthread_cond_destroy(&(exchange.changed));
+
+    arena_free(masses);
+    arena_free(y);
+    arena_free(temp);
+    for(i=0;i<4;i++){
+        arena_free(k[i]);
+    }
+    arena_free(blocks[0]);
+    arena_free(blocks[1]);
+    arena_free(message);
+    arena_free(sums);
+    return result;
+}
+
+static int distributed_writer(transport * t, double * starting_values, char ** variable_labels, FILE * fout){
+    // puts the workers' bodies back together into rows, in the same form as
+    // iterate_to_file() would write them. Returns 0 on success, or 1 if
+    // contact with a worker is lost.
+    int n = body_count, variable_count = 7 * n + 2;
+    int i, w, result = 0;
+    double * row = arena_malloc(sizeof(double) * variable_count);
+    double * message = arena_malloc(sizeof(double) * (2 + 7 * ((n + t->size - 1) / t->size)));
+    row[variable_count - 1] = starting_values[7 * n + 1];
+
+    for(i=0;i<variable_count;i++){
+        fprintf(fout, "%s,", variable_labels[i]);
+    }
+    fprintf(fout, "\n");
+
+    #ifdef COUNT_ALLOCATIONS
+    long allocations_after_first_step = -1;
+    #endif
+
+    int status = CONTINUE_ITERATING;
+    while(status == CONTINUE_ITERATING){
+        for(w=0;w<t->size;w++){
+            int first = w * n / t->size, count = (w + 1) * n / t->size - first;
+            if(t->recv(t, w, message, sizeof(double) * (2 + 7 * count)) != 0){
+                printf("Lost contact with worker %d.\n", w);
+                status = STOP_ITERATING;
+                result = 1;
+                break;
+            }
+            row[0] = message[0];
+            status = (int)message[1];
+            memcpy(&(row[1 + first * 7]), &(message[2]), sizeof(double) * 7 * count);
+        }
+        for(i=0;i<variable_count;i++){
+            fprintf(fout, "%lf,", row[i]);
+        }
+        fprintf(fout, "\n");
+        #ifdef COUNT_ALLOCATIONS
+        if(allocations_after_first_step < 0){
+            allocations_after_first_step = allocation_count;
+        }
+        #endif
+    }
+
+    #ifdef COUNT_ALLOCATIONS
+    check_allocations("the --distributed writer", allocations_after_first_step);
+    #endif
+    arena_free(row);
+    arena_free(message);
+    return result;
+}
+
+int distributed_free_3d_orbit(transport * t, double * starting_values, double step, char ** variable_labels, FILE * fout){
+    // runs whichever part t belongs to: a worker, or the writer. Returns 0 on
+    // success.
+    if(t->rank == t->size){
+        return distributed_writer(t, starting_values, variable_labels, fout);
+    }
+    return distributed_worker(t, starting_values, step);
+}
+
+static int distributed_worker_count(int worker_count){
+    // no more workers than bodies, and at least one
+    if(worker_count > body_count){
+        worker_count = body_count;
+    }
+    if(worker_count < 1){
+        worker_count = 1;
+    }
+    return worker_count;
+}
+
+size_t run_distributed_free_3d_orbit_size(int worker_count){
+    // what run_distributed_free_3d_orbit() takes from the arena. Each worker
+    // takes its share from its own copy of it after the fork, so only one
+    // worker's is counted, as well as the writer's.
+    worker_count = distributed_worker_count(worker_count);
+    int n = body_count, most = (n + worker_count - 1) / worker_count;
+    size_t transports = arena_size(sizeof(transport) * (worker_count + 1)) + worker_count * arena_size(sizeof(int) * 3)
+        + arena_size(sizeof(int) * worker_count) + arena_size(sizeof(pid_t) * worker_count);
+    size_t worker = arena_size(sizeof(double) * n) + 6 * arena_size(sizeof(double) * most * 6)
+        + 2 * arena_size(sizeof(double) * (2 + 3 * most)) + arena_size(sizeof(double) * (2 + 7 * most))
+        + arena_size(sizeof(double) * most * 3);
+    size_t writer = arena_size(sizeof(double) * (7 * n + 2)) + arena_size(sizeof(double) * (2 + 7 * most));
+    return transports + worker + writer;
+}
+
+int run_distributed_free_3d_orbit(int worker_count, double * starting_values, double step, char ** variable_labels, FILE * fout){
+    /*
+    Splits a --free --3D simulation across worker_count processes on this
+    machine, talking over Unix sockets, with this process writing the output.
+    Memory comes from the arena in use, which the workers inherit (see
+    run_distributed_free_3d_orbit_size()). Returns 0 on success.
+    */
+    worker_count = distributed_worker_count(worker_count);
+
+    transport * transports = unix_socket_transports(worker_count);
+    if(transports == NULL){
+        printf("Could not connect the workers.\n");
+        return 1;
+    }
+    pid_t * workers = arena_malloc(sizeof(pid_t) * worker_count);
+    int i, result = 0;
+
+    // anything still buffered would otherwise be written once by each worker
+    fflush(fout);
+    for(i=0;i<worker_count;i++){
+        workers[i] = fork();
+        if(workers[i] == 0){
+            transport * t = attach_unix_socket_transport(transports, i);
+            int failed = distributed_free_3d_orbit(t, starting_values, step, variable_labels, fout);
+            t->close(t);
+            _exit(failed);
+        }else if(workers[i] < 0){
+            printf("Could not start worker %d.\n", i);
+            result = 1;
+            worker_count = i;
+            break;
+        }
+    }
+
+    transport * writer = attach_unix_socket_transport(transports, transports[0].size);
+    if(result == 0){
+        result = distributed_free_3d_orbit(writer, starting_values, step, variable_labels, fout);
+    }
+    writer->close(writer);
+    for(i=0;i<worker_count;i++){
+        int worker_status;
+        waitpid(workers[i], &worker_status, 0);
+        if(!WIFEXITED(worker_status) || WEXITSTATUS(worker_status) != 0){
+            result = 1;
+        }
+    }
+
+    arena_free(workers);
+    arena_free(transports);
+    return result;
+}
@@ -0,0 +1,40 @@
+/*
+    (c) Tom Robbins 2012
+
+*/
+
+#import "rk_functions.h"
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+// peers a worker can talk to. The writer is the process which collects the
+// workers' bodies into rows of output, and talks to worker n as peer n.
+#define PEER_NEXT 0
+#define PEER_PREVIOUS 1
+#define PEER_WRITER 2
+
+/*
+Moves data between processes. rank is the worker number (or size for the
+writer) and size is the number of workers. send and recv block until all of
+the bytes have gone or arrived and return 0 on success. Anything which can do
+this (ie, MPI or a real interconnect) can be used by filling in one of these.
+*/
+typedef struct transport transport;
+struct transport {
+    int rank;
+    int size;
+    int(*send)(transport * t, int peer, void * data, size_t bytes);
+    int(*recv)(transport * t, int peer, void * data, size_t bytes);
+    void(*close)(transport * t);
+    void * state;
+};
+
+transport * unix_socket_transports(int worker_count);
+transport * attach_unix_socket_transport(transport * transports, int rank);
+int distributed_free_3d_orbit(transport * t, double * starting_values, double step, char ** variable_labels, FILE * fout);
+size_t run_distributed_free_3d_orbit_size(int worker_count);
+int run_distributed_free_3d_orbit(int worker_count, double * starting_values, double step, char ** variable_labels, FILE * fout);
@@ -6,43 +6,487 @@
 #ifndef LIB_INCLUDED
 
 #include "lib.h"
-#define USE_VAR_POOL
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
 //#define PRINT_KVALS
 
-void iterate_to_file(int(*iter_func)(double *, double *, double), int variable_count, double * starting_values, double independent_variable_step, char ** variable_labels, FILE * fout){
-    if(fout == NULL){
+// number of steps a Jacobian (and the LU factorisation built from it) is
+// reused for before it is evaluated again
+#define ROSENBROCK_JACOBIAN_AGE 16
+// gamma = 1 + 1/sqrt(2) for the 2 stage, L-stable Rosenbrock-W method
+#define ROSENBROCK_GAMMA 1.7071067811865475
+
+// thread local so that each parareal worker can have its own pool
+static _Thread_local double * variable_pool = NULL;
+
+// the most columns (and so the highest order) bulirsch_stoer() will try
+#define BULIRSCH_STOER_MAX_COLUMNS 8
+// the most substeps of one call to bulirsch_stoer() that are kept for
+// bulirsch_stoer_dense_output()
+#define BULIRSCH_STOER_DENSE_STEPS 64
+
+static sparse_matrix * rosenbrock_jacobian = NULL;
+static void(*rosenbrock_user_jacobian)(double *, sparse_matrix *) = NULL;
+static double * rosenbrock_pool = NULL;
+static sparse_matrix * rosenbrock_lu = NULL;
+static int * rosenbrock_diagonal = NULL;
+static int rosenbrock_age = 0;
+static int rosenbrock_autonomous = 0;
+static int * rosenbrock_colour = NULL;
+static int rosenbrock_colour_count = 0;
+static int * rosenbrock_column_start = NULL;
+static int * rosenbrock_column_row = NULL;
+static int * rosenbrock_column_entry = NULL;
+static double * rosenbrock_perturbed = NULL;
+static double rosenbrock_factored_step = 0;
+
+static double * bulirsch_stoer_pool = NULL;
+static double bulirsch_stoer_tolerance = BULIRSCH_STOER_TOLERANCE;
+static double bulirsch_stoer_step = 0;
+static int bulirsch_stoer_columns = 4;
+static int bulirsch_stoer_warned = 0;
+// the start of each substep of the last call, how many columns it took, and
+// where the call ended. The count is -1 if there were too many to keep.
+static double * bulirsch_stoer_substeps = NULL;
+static int bulirsch_stoer_substep_columns[BULIRSCH_STOER_DENSE_STEPS];
+static int bulirsch_stoer_substep_count = 0;
+static double bulirsch_stoer_end_time = 0;
+static double(*bulirsch_stoer_func)(double *, int) = NULL;
+static int bulirsch_stoer_var_count = 0;
+static int bulirsch_stoer_const_count = 0;
+static int bulirsch_stoer_dense_warned = 0;
+
+#ifdef COUNT_ALLOCATIONS
+long allocation_count = 0;
+
+// glibc's own allocator, which these pass on to. Defining malloc() here (rather
+// than, say, linking with --wrap=malloc) means calls from inside the C library
+// come here as well.
+void * __libc_malloc(size_t size);
+void * __libc_calloc(size_t count, size_t size);
+void * __libc_realloc(void * pointer, size_t size);
+
+void * malloc(size_t size){
+    __atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void * calloc(size_t count, size_t size){
+    __atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(count, size);
+}
+
+void * realloc(void * pointer, size_t size){
+    __atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(pointer, size);
+}
+
+void check_allocations(char * loop, long after_first_step){
+    // warns if any allocations have been made since after_first_step was taken
+    if(after_first_step >= 0 && allocation_count != after_first_step){
+        fprintf(stderr, "%ld heap allocations were made after the first step of %s.\n", allocation_count - after_first_step, loop);
+    }
+}
+#endif
+
+// the arena arena_malloc() takes from. Thread local, as an arena is not safe to
+// share between threads: parareal_to_file() hands each worker a piece of its own.
+static _Thread_local arena * current_arena = NULL;
+
+size_t arena_size(size_t bytes){
+    // how much of an arena an allocation of bytes takes up
+    return (bytes + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+}
+
+arena * create_arena(size_t size, int huge_pages){
+    /*
+    Maps size bytes (plus room for the arena itself) in one go. With
+    huge_pages, the kernel is asked to back it with huge pages where it can,
+    which cuts TLB misses on big runs. Returns NULL if the memory can not be
+    had.
+    */
+    size_t total = arena_size(sizeof(arena)) + arena_size(size);
+    void * memory = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(memory == MAP_FAILED){
+        return NULL;
+    }
+    #ifdef MADV_HUGEPAGE
+    if(huge_pages){
+        madvise(memory, total, MADV_HUGEPAGE);
+    }
+    #endif
+    arena * a = memory;
+    a->base = (char *)memory + arena_size(sizeof(arena));
+    a->size = arena_size(size);
+    a->used = 0;
+    return a;
+}
+
+void free_arena(arena * a){
+    if(a == NULL){
         return;
     }
+    if(current_arena == a){
+        current_arena = NULL;
+    }
+    munmap(a, arena_size(sizeof(arena)) + a->size);
+}
+
+void * arena_alloc(arena * a, size_t bytes){
+    // returns NULL if there is not enough room left
+    if(a == NULL || a->used + arena_size(bytes) > a->size){
+        return NULL;
+    }
+    void * pointer = a->base + a->used;
+    a->used += arena_size(bytes);
+    return pointer;
+}
+
+static void split_arena(arena * part, size_t bytes){
+    // makes part an arena of bytes taken from the one in use (or the heap), to
+    // hand to another thread. Free part->base with arena_free() when done.
+    part->size = arena_size(bytes);
+    part->base = arena_malloc(part->size);
+    part->used = 0;
+}
 
+void use_arena(arena * a){
+    // the set up functions in this library (and anything else which uses
+    // arena_malloc()) take their memory from a until this is called again.
+    current_arena = a;
+}
+
+void * arena_malloc(size_t bytes){
+    // from the arena in use if there is room, otherwise from the heap
+    void * pointer = arena_alloc(current_arena, bytes);
+    if(pointer == NULL){
+        pointer = malloc(bytes);
+    }
+    return pointer;
+}
+
+void arena_free(void * pointer){
+    // memory from an arena is given back all at once by free_arena()
+    if(current_arena != NULL && (char *)pointer >= current_arena->base && (char *)pointer < current_arena->base + current_arena->size){
+        return;
+    }
+    free(pointer);
+}
+
+static event * events = NULL;
+static int event_count = 0;
+static FILE * event_log = NULL;
+static FILE * event_checkpoint = NULL;
+static char * event_checkpoint_buffer = NULL;
+static double * event_times = NULL;
+static double(*event_system)(double *, int) = NULL;
+static int event_system_count = 0;
+static int(*event_dense_output)(double, double *) = NULL;
+
+static void write_row(FILE * fout, double * values, int count){
     int i;
-    for(i=0;i<variable_count;i++){
-        fprintf(fout, "%s,", variable_labels[i]);
+    for(i=0;i<count;i++){
+        fprintf(fout, "%lf,", values[i]);
+    }
+    fprintf(fout, "\n");
+}
+
+static void write_labels(FILE * fout, char ** labels, int count){
+    int i;
+    for(i=0;i<count;i++){
+        fprintf(fout, "%s,", labels[i]);
     }
     fprintf(fout, "\n");
+}
+
+void set_up_events(event * new_events, int new_event_count, double(*system)(double *, int), int system_variable_count, FILE * log, char * checkpoint_path){
+    /*
+    Events are checked after every step of iterate_to_file() until
+    free_events() is called. The array is copied. log and checkpoint_path may
+    be NULL if no event logs or checkpoints.
+
+    system and system_variable_count are what is passed to the step method
+    (ie, runge_kutta_4th()), and are used to interpolate within a step. If
+    system is NULL, the state is interpolated linearly.
+
+    The checkpoint file is opened here, with a buffer from the arena, and
+    rewritten in place at each checkpoint so that no allocations are needed
+    while stepping.
+    */
+    events = arena_malloc(sizeof(event) * new_event_count);
+    memcpy(events, new_events, sizeof(event) * new_event_count);
+    event_count = new_event_count;
+    event_times = arena_malloc(sizeof(double) * new_event_count);
+    event_system = system;
+    event_system_count = system_variable_count;
+    event_log = log;
+    event_checkpoint = NULL;
+    if(checkpoint_path != NULL){
+        event_checkpoint = fopen(checkpoint_path, "w");
+        if(event_checkpoint == NULL){
+            printf("Could not open checkpoint file at %s for writing.\n", checkpoint_path);
+        }else{
+            event_checkpoint_buffer = arena_malloc(BUFSIZ);
+            setvbuf(event_checkpoint, event_checkpoint_buffer, _IOFBF, BUFSIZ);
+        }
+    }
+}
+
+void set_event_dense_output(int(*dense_output)(double, double *)){
+    /*
+    dense_output(time, state), if not NULL, fills in the time, dependent
+    variables and constants of state at a time within the step just taken,
+    more accurately than the cubic through its ends (ie, from the step
+    method's own substeps). It returns nonzero, leaving state alone, where it
+    can't. Cleared by free_events().
+    */
+    event_dense_output = dense_output;
+}
+
+void free_events(){
+    if(event_checkpoint != NULL){
+        fclose(event_checkpoint);
+        arena_free(event_checkpoint_buffer);
+        event_checkpoint = NULL;
+    }
+    arena_free(events);
+    arena_free(event_times);
+    events = NULL;
+    event_count = 0;
+    event_dense_output = NULL;
+}
+
+static int event_after(double before, double value){
+    // whether value is on the far side of a sign change from before
+    return before < 0 ? value >= 0 : value <= 0;
+}
+
+static int event_crossed(event * e, double before, double after){
+    if(before < 0 && after >= 0){
+        return e->direction != EVENT_FALLING;
+    }
+    if(before > 0 && after <= 0){
+        return e->direction != EVENT_RISING;
+    }
+    return 0;
+}
+
+static void event_rates(double * previous, double * next, double * rates){
+    // the rates of the system's dependent variables at either end of the step,
+    // for event_interpolate()
+    int i, n = event_system_count - 1;
+    for(i=1;i<event_system_count;i++){
+        rates[i - 1] = event_system(previous, i);
+        rates[n + i - 1] = event_system(next, i);
+    }
+}
+
+static void event_interpolate(double * previous, double * next, double * rates, int variable_count, double s, double * state){
+    /*
+    The state a fraction s of the way through the step from previous to next.
+    The system's dependent variables are interpolated by the cubic Hermite
+    polynomial through their values and rates at either end, which is accurate
+    to order h^4 (as is runge_kutta_4th() over a whole run). Anything else (the
+    time, constants and other outputs) is interpolated linearly. Where there
+    is a dense output from set_event_dense_output(), it replaces the cubic.
+    */
+    int i, n = event_system_count - 1;
+    double h = next[0] - previous[0];
+    for(i=0;i<variable_count;i++){
+        state[i] = previous[i] + s * (next[i] - previous[i]);
+    }
+    if(event_dense_output != NULL && event_dense_output(previous[0] + s * h, state) == 0){
+        return;
+    }
+    if(event_system == NULL){
+        return;
+    }
+    double h00 = (1 + 2 * s) * (1 - s) * (1 - s), h10 = s * (1 - s) * (1 - s);
+    double h01 = s * s * (3 - 2 * s), h11 = s * s * (s - 1);
+    for(i=1;i<event_system_count;i++){
+        state[i] = h00 * previous[i] + h10 * h * rates[i - 1] + h01 * next[i] + h11 * h * rates[n + i - 1];
+    }
+}
+
+static double locate_event(event * e, double * previous, double * next, double * rates, double * trial, int variable_count, double before, double after){
+    /*
+    Finds the fraction of the step at which e happens by the Illinois method,
+    on the interpolant from event_interpolate(), so no more steps are taken.
+    Returns the end of the bracket which is past the event.
+    */
+    double a = 0, b = 1, ga = before, gb = after;
+    int side = 0, i;
+    for(i=0;i<100 && b - a > EVENT_TOLERANCE;i++){
+        double c = (a * gb - b * ga) / (gb - ga);
+        if(!(c > a && c < b)){
+            c = .5 * (a + b);
+        }
+        event_interpolate(previous, next, rates, variable_count, c, trial);
+        double gc = e->function(trial);
+        if(event_after(before, gc)){
+            b = c;
+            gb = gc;
+            if(side == 1){
+                ga /= 2;
+            }
+            side = 1;
+        }else{
+            a = c;
+            ga = gc;
+            if(side == -1){
+                gb /= 2;
+            }
+            side = -1;
+        }
+    }
+    return b;
+}
+
+static int handle_events(double * previous, double * next, double * before, double * after, double * trial, double * rates,
+        int variable_count, char ** variable_labels, int status){
+    // checks for any events between previous and next and deals with them in
+    // time order. before holds each event function at previous, and is
+    // updated to next. status is what the step returned; the status to go on
+    // with is returned, which is to continue if the step is cut short before
+    // it (ie, before the time limit) unless by an EVENT_STOP event.
+    int e, found = 0;
+    for(e=0;e<event_count;e++){
+        after[e] = events[e].function(next);
+        event_times[e] = -1;
+        if(event_crossed(&(events[e]), before[e], after[e])){
+            if(!found && event_system != NULL){
+                event_rates(previous, next, rates);
+            }
+            found = 1;
+            event_times[e] = locate_event(&(events[e]), previous, next, rates, trial, variable_count, before[e], after[e]);
+        }
+    }
+
+    while(found){
+        // the earliest event not yet handled
+        int first = -1;
+        for(e=0;e<event_count;e++){
+            if(event_times[e] >= 0 && (first < 0 || event_times[e] < event_times[first])){
+                first = e;
+            }
+        }
+        if(first < 0){
+            break;
+        }
+        event_interpolate(previous, next, rates, variable_count, event_times[first], trial);
+        event_times[first] = -1;
+
+        if(events[first].actions & EVENT_LOG && event_log != NULL){
+            fprintf(event_log, "%s,", events[first].name);
+            write_row(event_log, trial, variable_count);
+        }
+        if(events[first].actions & EVENT_CHECKPOINT && event_checkpoint != NULL){
+            rewind(event_checkpoint);
+            ftruncate(fileno(event_checkpoint), 0);
+            write_labels(event_checkpoint, variable_labels, variable_count);
+            write_row(event_checkpoint, trial, variable_count);
+            fflush(event_checkpoint);
+        }
+        if(events[first].actions & (EVENT_STOP | EVENT_REDUCE_STEP)){
+            // cut the step short at the event. Anything after it will be found
+            // again on the next step.
+            memcpy(next, trial, sizeof(double) * variable_count);
+            for(e=0;e<event_count;e++){
+                after[e] = events[e].function(next);
+            }
+            status = events[first].actions & EVENT_STOP ? STOP_ITERATING : CONTINUE_ITERATING;
+            break;
+        }
+    }
+
+    for(e=0;e<event_count;e++){
+        before[e] = after[e];
+    }
+    return status;
+}
+
+size_t iterate_to_file_size(int variable_count){
+    // the state before and after each step, one for finding events and the
+    // rates at either end of the step to interpolate with
+    return 3 * arena_size(sizeof(double) * variable_count) + arena_size(sizeof(double) * 2 * variable_count);
+}
+
+void iterate_to_file(int(*iter_func)(double *, double *, double), int variable_count, double * starting_values, double independent_variable_step, char ** variable_labels, FILE * fout){
+    if(fout == NULL){
+        return;
+    }
+
+    int i;
+    write_labels(fout, variable_labels, variable_count);
 
     // copy the starting values in case they need to be used elsewhere
-    double * variables = malloc(sizeof(double) * variable_count);
+    double * variables = arena_malloc(sizeof(double) * variable_count);
     for(i=0;i<variable_count;i++){
         variables[i] = starting_values[i];
     }
 
-    double * previous = malloc(sizeof(double) * variable_count);
+    double * previous = arena_malloc(sizeof(double) * variable_count);
     double * next = variables;
 
+    // the event functions at the start of each step, their values at the end,
+    // a state for finding where in the step they happen and the rates to
+    // interpolate it with
+    double * before = NULL, * after = NULL, * trial = NULL, * rates = NULL;
+    if(event_count > 0){
+        before = arena_malloc(sizeof(double) * event_count);
+        after = arena_malloc(sizeof(double) * event_count);
+        trial = arena_malloc(sizeof(double) * variable_count);
+        rates = arena_malloc(sizeof(double) * 2 * variable_count);
+        for(i=0;i<event_count;i++){
+            before[i] = events[i].function(next);
+        }
+        if(event_log != NULL){
+            fprintf(event_log, "event,");
+            write_labels(event_log, variable_labels, variable_count);
+        }
+    }
+
+    #ifdef COUNT_ALLOCATIONS
+    long allocations_after_first_step = -1;
+    #endif
+
     // iter_func is called with the following parameters:
     // iter_func(double * in_variables, double * out_variables, double step)
+    int status;
     do{
-        for(i=0;i<variable_count;i++){
-            fprintf(fout, "%lf,", next[i]);
-        }
+        write_row(fout, next, variable_count);
 
         // swap the pointers (ah yes, the old switcheroo)
         double * temp = previous;
         previous = next;
         next = temp;
 
-        fprintf(fout, "\n");
-    }while((iter_func(previous, next, independent_variable_step) == CONTINUE_ITERATING));
+        status = iter_func(previous, next, independent_variable_step);
+        if(event_count > 0){
+            status = handle_events(previous, next, before, after, trial, rates,
+                variable_count, variable_labels, status);
+        }
+        #ifdef COUNT_ALLOCATIONS
+        if(allocations_after_first_step < 0){
+            allocations_after_first_step = allocation_count;
+        }
+        #endif
+    }while(status == CONTINUE_ITERATING);
+
+    // the final state, ie, at the time limit or stopping event
+    write_row(fout, next, variable_count);
+
+    #ifdef COUNT_ALLOCATIONS
+    check_allocations("iterate_to_file()", allocations_after_first_step);
+    #endif
+
+    arena_free(variables);
+    arena_free(previous);
+    arena_free(before);
+    arena_free(after);
+    arena_free(trial);
+    arena_free(rates);
 }
 
 void runge_kutta_4th(double(*func)(double *, int), double * vars_in, double * vars_out, int var_count, int const_count, double step){
@@ -65,15 +509,9 @@ void runge_kutta_4th(double(*func)(double *, int), double * vars_in, double * va
     #endif
 
     // set up variables using the variable pool:
-    #ifdef USE_VAR_POOL
     double * temp = variable_pool;
     double * k[] = {&(variable_pool[const_count + var_count]), &(variable_pool[const_count + var_count + (var_count - 1)]),
          &(variable_pool[const_count + var_count + (var_count - 1) * 2]), &(variable_pool[const_count + var_count + (var_count - 1) * 3])};
-    #else
-    double * temp = malloc(sizeof(double) * (const_count + var_count));
-    double * k[] = { malloc(sizeof(double) * (var_count - 1)), malloc(sizeof(double) * (var_count - 1)), malloc(sizeof(double) * (var_count - 1)),
-        malloc(sizeof(double) * (var_count - 1)) };
-    #endif
 
     // copy the constants first:
     int i, j;
@@ -135,14 +573,57 @@ void runge_kutta_4th(double(*func)(double *, int), double * vars_in, double * va
 
     // always assume the 0th variable is the independent one.
     vars_out[0] = vars_in[0] + step;
+}
+
+void runge_kutta_4th_system(void(*derivatives)(double *, double *), double * vars_in, double * vars_out, int var_count, int const_count, double step){
+    /*
+    The same as runge_kutta_4th(), except that the whole system is evaluated in
+    one call: derivatives(vars, rates) fills rates[i - 1] with the derivative of
+    variable i. This suits large, sparsely coupled systems where working out
+    each equation on its own would repeat work shared between them. Uses the
+    pool from set_up_runge_kutta_4th().
+    */
+    double * temp = variable_pool;
+    double * k[] = {&(variable_pool[const_count + var_count]), &(variable_pool[const_count + var_count + (var_count - 1)]),
+         &(variable_pool[const_count + var_count + (var_count - 1) * 2]), &(variable_pool[const_count + var_count + (var_count - 1) * 3])};
 
-    #ifndef USE_VAR_POOL
-    free(temp);
-    for(i=0;i<4;i++){
-        free(k[i]);
+    int i;
+    for(i=var_count;i<const_count + var_count;i++){
+        vars_out[i] = vars_in[i];
+        temp[i] = vars_in[i];
     }
-    #endif
 
+    // k1
+    derivatives(vars_in, k[0]);
+
+    // k2
+    temp[0] = vars_in[0] + step/2;
+    for(i=1;i<var_count;i++){
+        temp[i] = vars_in[i] + step * k[0][i-1] / 2;
+    }
+    derivatives(temp, k[1]);
+
+    // k3
+    for(i=1;i<var_count;i++){
+        temp[i] = vars_in[i] + step * k[1][i-1] / 2;
+    }
+    derivatives(temp, k[2]);
+
+    // k4
+    temp[0] = vars_in[0] + step;
+    for(i=1;i<var_count;i++){
+        temp[i] = vars_in[i] + step * k[2][i-1];
+    }
+    derivatives(temp, k[3]);
+
+    for(i=1;i<var_count;i++){
+        vars_out[i] = vars_in[i] + step/6*(k[0][i-1] + 2*k[1][i-1] + 2*k[2][i-1] + k[3][i-1]);
+    }
+    vars_out[0] = vars_in[0] + step;
+}
+
+size_t runge_kutta_4th_size(int variable_count, int constant_count){
+    return arena_size(sizeof(double) * (4 * (variable_count - 1) + constant_count + variable_count));
 }
 
 void set_up_runge_kutta_4th(int variable_count, int constant_count){
@@ -150,12 +631,1078 @@ void set_up_runge_kutta_4th(int variable_count, int constant_count){
     // made per simulation.
 
     // for each variable, we need 4 k-values, as well as a temporary copy.
-    variable_pool = malloc(sizeof(double) * (4 * (variable_count - 1) + constant_count + variable_count));
+    variable_pool = arena_malloc(sizeof(double) * (4 * (variable_count - 1) + constant_count + variable_count));
 }
 
 void free_runge_kutta_4th(){
     // you must always call this function between simulations!!!
-    free(variable_pool);
+    arena_free(variable_pool);
+}
+
+static void bulirsch_stoer_midpoint(double(*func)(double *, int), double * vars_in, double * f0, double * result, int var_count, int const_count, double step, int substeps){
+    // modified midpoint method across step with the given number of substeps.
+    // The result only has its dependent variables set.
+    double * previous = bulirsch_stoer_pool;
+    double * current = &(bulirsch_stoer_pool[var_count + const_count]);
+    double * derivative = &(bulirsch_stoer_pool[2 * (var_count + const_count)]);
+    double h = step / substeps;
+    int i, m;
+
+    for(i=0;i<var_count + const_count;i++){
+        previous[i] = vars_in[i];
+        current[i] = vars_in[i];
+    }
+    for(i=1;i<var_count;i++){
+        current[i] = vars_in[i] + h * f0[i-1];
+    }
+    current[0] = vars_in[0] + h;
+
+    for(m=1;m<substeps;m++){
+        for(i=1;i<var_count;i++){
+            derivative[i-1] = func(current, i);
+        }
+        for(i=1;i<var_count;i++){
+            double next = previous[i] + 2 * h * derivative[i-1];
+            previous[i] = current[i];
+            current[i] = next;
+        }
+        previous[0] = current[0];
+        current[0] = vars_in[0] + (m + 1) * h;
+    }
+
+    for(i=1;i<var_count;i++){
+        derivative[i-1] = func(current, i);
+    }
+    for(i=1;i<var_count;i++){
+        result[i-1] = .5 * (current[i] + previous[i] + h * derivative[i-1]);
+    }
+}
+
+static void bulirsch_stoer_row(double(*func)(double *, int), double * y, double * f0, double * table, int var_count, int const_count, double h, int k){
+    // row k of the extrapolation table for a substep h from y: the midpoint
+    // method with 2(k + 1) substeps, extrapolated along the row. row[j] uses
+    // row[j-1] and the row above's [j-1], so rows 0 to k - 1 must be done.
+    int n = var_count - 1;
+    int i, j;
+    double * row = &(table[k * BULIRSCH_STOER_MAX_COLUMNS * n]);
+    bulirsch_stoer_midpoint(func, y, f0, row, var_count, const_count, h, 2 * (k + 1));
+    for(j=1;j<=k;j++){
+        double * above = &(table[((k - 1) * BULIRSCH_STOER_MAX_COLUMNS + j - 1) * n]);
+        double ratio = (double)(k + 1) / (k + 1 - j);
+        double factor = 1 / (ratio * ratio - 1);
+        for(i=0;i<n;i++){
+            row[j * n + i] = row[(j - 1) * n + i] + (row[(j - 1) * n + i] - above[i]) * factor;
+        }
+    }
+}
+
+void bulirsch_stoer(double(*func)(double *, int), double * vars_in, double * vars_out, int var_count, int const_count, double step){
+    /*
+    Gragg-Bulirsch-Stoer extrapolation, called in the same way as
+    runge_kutta_4th(). The modified midpoint method is run across a substep H
+    with 2, 4, 6... substeps and the results are extrapolated to zero step size
+    (Aitken-Neville, in H^2). Each extra column raises the order by 2.
+
+    step here is only how far to go, ie, the output interval. It is covered in
+    as many substeps H as are needed to keep the estimated relative error of
+    each below the tolerance given to set_up_bulirsch_stoer(). H and the number
+    of columns are adapted to keep the work per unit time down, and carry over
+    between calls. H is never less than a few units in the last place of the
+    time (ie, at a collision): a substep that short is taken whatever its
+    error, with a warning, so that the run still moves on. The substeps are
+    kept for bulirsch_stoer_dense_output().
+    */
+    int n = var_count - 1;
+    int size = var_count + const_count;
+    double * y = &(bulirsch_stoer_pool[2 * size + n]);
+    double * f0 = &(bulirsch_stoer_pool[3 * size + n]);
+    double * table = &(bulirsch_stoer_pool[3 * size + 2 * n]);
+    double work[BULIRSCH_STOER_MAX_COLUMNS], new_step[BULIRSCH_STOER_MAX_COLUMNS];
+    int i, k;
+
+    // work[k] is the number of function evaluations for k + 1 columns
+    work[0] = 3;
+    for(k=1;k<BULIRSCH_STOER_MAX_COLUMNS;k++){
+        work[k] = work[k-1] + 2 * (k + 1);
+    }
+
+    for(i=0;i<size;i++){
+        y[i] = vars_in[i];
+    }
+    double end_time = vars_in[0] + step;
+    if(bulirsch_stoer_step <= 0){
+        bulirsch_stoer_step = step;
+    }
+    bulirsch_stoer_func = func;
+    bulirsch_stoer_var_count = var_count;
+    bulirsch_stoer_const_count = const_count;
+    bulirsch_stoer_substep_count = 0;
+    bulirsch_stoer_end_time = end_time;
+
+    while(end_time - y[0] > fabs(step) * 1E-12){
+        double min_step = fmax(fabs(y[0]), fabs(step)) * DBL_EPSILON * 16;
+        double h = fmax(bulirsch_stoer_step, min_step);
+        int shortened = 0;
+        if(h >= end_time - y[0]){
+            h = end_time - y[0];
+            shortened = 1;
+        }
+
+        for(i=1;i<var_count;i++){
+            f0[i-1] = func(y, i);
+        }
+
+        int accepted = -1;
+        for(k=0;k<BULIRSCH_STOER_MAX_COLUMNS;k++){
+            double * row = &(table[k * BULIRSCH_STOER_MAX_COLUMNS * n]);
+            bulirsch_stoer_row(func, y, f0, table, var_count, const_count, h, k);
+            if(k == 0){
+                continue;
+            }
+
+            double error = 0;
+            for(i=0;i<n;i++){
+                double scale = bulirsch_stoer_tolerance * fmax(fmax(fabs(y[i+1]), fabs(row[k * n + i])), 1);
+                double e = fabs(row[k * n + i] - row[(k - 1) * n + i]) / scale;
+                if(e > error){
+                    error = e;
+                }
+            }
+            // the step which would just meet the tolerance with this many columns
+            new_step[k] = error > 0 ? h * .94 * pow(.65 / error, 1. / (2 * k + 1)) : 4 * h;
+            if(new_step[k] > 4 * h){
+                new_step[k] = 4 * h;
+            }
+
+            if(error <= 1){
+                accepted = k;
+                break;
+            }
+            if(k >= bulirsch_stoer_columns || k == BULIRSCH_STOER_MAX_COLUMNS - 1){
+                // not converging fast enough, so try again with a smaller step
+                break;
+            }
+        }
+
+        if(accepted < 0 && h > min_step){
+            bulirsch_stoer_step = new_step[k];
+            continue;
+        }
+        if(accepted < 0){
+            // the step can't get any smaller, so take the best estimate there is
+            if(!bulirsch_stoer_warned){
+                fprintf(stderr, "Bulirsch-Stoer step fell to its minimum at t=%lf; the tolerance is not being met.\n", y[0]);
+                bulirsch_stoer_warned = 1;
+            }
+            accepted = k;
+        }
+
+        if(bulirsch_stoer_substep_count >= 0 && bulirsch_stoer_substep_count < BULIRSCH_STOER_DENSE_STEPS){
+            memcpy(&(bulirsch_stoer_substeps[bulirsch_stoer_substep_count * size]), y, sizeof(double) * size);
+            bulirsch_stoer_substep_columns[bulirsch_stoer_substep_count++] = accepted + 1;
+        }else{
+            bulirsch_stoer_substep_count = -1;
+        }
+        for(i=1;i<var_count;i++){
+            y[i] = table[(accepted * BULIRSCH_STOER_MAX_COLUMNS + accepted) * n + i - 1];
+        }
+        y[0] = shortened ? end_time : y[0] + h;
+
+        // pick the number of columns with the least work per unit time for the
+        // next step, and try one more if that is the most we used.
+        int best = 1;
+        for(k=2;k<=accepted;k++){
+            if(work[k] / new_step[k] < work[best] / new_step[best]){
+                best = k;
+            }
+        }
+        double next_step = new_step[best];
+        if(best == accepted && best + 1 < BULIRSCH_STOER_MAX_COLUMNS){
+            next_step = new_step[best] * work[best + 1] / work[best];
+            best ++;
+        }
+        bulirsch_stoer_columns = best + 1;
+        if(!shortened || next_step > bulirsch_stoer_step){
+            bulirsch_stoer_step = next_step;
+        }
+    }
+
+    for(i=0;i<size;i++){
+        vars_out[i] = y[i];
+    }
+    vars_out[0] = end_time;
+}
+
+int bulirsch_stoer_dense_output(double time, double * state){
+    /*
+    The state at time within the last call to bulirsch_stoer(), for
+    set_event_dense_output(). The substep time falls in is taken again from
+    its start, only as far as time and with as many columns as it used, so
+    the result is as accurate as the substeps themselves. Sets the time,
+    dependent variables and constants of state and returns 0, or returns 1 if
+    time is outside the call or the call took more than
+    BULIRSCH_STOER_DENSE_STEPS substeps.
+    */
+    int var_count = bulirsch_stoer_var_count, const_count = bulirsch_stoer_const_count;
+    int n = var_count - 1;
+    int size = var_count + const_count;
+    double * f0 = &(bulirsch_stoer_pool[3 * size + n]);
+    double * table = &(bulirsch_stoer_pool[3 * size + 2 * n]);
+    int i, k;
+
+    if(bulirsch_stoer_substep_count < 0 && !bulirsch_stoer_dense_warned){
+        fprintf(stderr, "More than %d Bulirsch-Stoer substeps in one output interval; events in such intervals are located on a cubic, less accurately.\n",
+            BULIRSCH_STOER_DENSE_STEPS);
+        bulirsch_stoer_dense_warned = 1;
+    }
+    if(bulirsch_stoer_substep_count <= 0){
+        return 1;
+    }
+    double start_time = bulirsch_stoer_substeps[0];
+    if(time < start_time || time > bulirsch_stoer_end_time + (bulirsch_stoer_end_time - start_time) * 1E-9){
+        return 1;
+    }
+
+    for(k=bulirsch_stoer_substep_count-1;k>0 && bulirsch_stoer_substeps[k * size] > time;k--);
+    double * y = &(bulirsch_stoer_substeps[k * size]);
+    double h = fmin(time, bulirsch_stoer_end_time) - y[0];
+    int columns = bulirsch_stoer_substep_columns[k];
+    memcpy(state, y, sizeof(double) * size);
+    state[0] = time;
+    if(h <= 0){
+        return 0;
+    }
+
+    for(i=1;i<var_count;i++){
+        f0[i-1] = bulirsch_stoer_func(y, i);
+    }
+    for(k=0;k<columns;k++){
+        bulirsch_stoer_row(bulirsch_stoer_func, y, f0, table, var_count, const_count, h, k);
+    }
+    for(i=1;i<var_count;i++){
+        state[i] = table[((columns - 1) * BULIRSCH_STOER_MAX_COLUMNS + columns - 1) * n + i - 1];
+    }
+    return 0;
+}
+
+size_t bulirsch_stoer_size(int variable_count, int constant_count){
+    int n = variable_count - 1;
+    return arena_size(sizeof(double) * (3 * (variable_count + constant_count) + 2 * n
+        + BULIRSCH_STOER_MAX_COLUMNS * BULIRSCH_STOER_MAX_COLUMNS * n
+        + BULIRSCH_STOER_DENSE_STEPS * (variable_count + constant_count)));
+}
+
+void set_up_bulirsch_stoer(int variable_count, int constant_count, double tolerance){
+    int n = variable_count - 1;
+    // two copies of the variables and a derivative for the midpoint method,
+    // the current state, f(y), the extrapolation table and the start of each
+    // substep.
+    bulirsch_stoer_pool = arena_malloc(sizeof(double) * (3 * (variable_count + constant_count) + 2 * n
+        + BULIRSCH_STOER_MAX_COLUMNS * BULIRSCH_STOER_MAX_COLUMNS * n
+        + BULIRSCH_STOER_DENSE_STEPS * (variable_count + constant_count)));
+    bulirsch_stoer_substeps = &(bulirsch_stoer_pool[3 * (variable_count + constant_count) + 2 * n
+        + BULIRSCH_STOER_MAX_COLUMNS * BULIRSCH_STOER_MAX_COLUMNS * n]);
+    bulirsch_stoer_substep_count = 0;
+    bulirsch_stoer_dense_warned = 0;
+    bulirsch_stoer_tolerance = tolerance;
+    bulirsch_stoer_step = 0;
+    bulirsch_stoer_columns = 4;
+    bulirsch_stoer_warned = 0;
+}
+
+void free_bulirsch_stoer(){
+    // as with free_runge_kutta_4th(), call this between simulations.
+    arena_free(bulirsch_stoer_pool);
+    bulirsch_stoer_pool = NULL;
+    bulirsch_stoer_substeps = NULL;
+    bulirsch_stoer_substep_count = 0;
+}
+
+size_t sparse_matrix_size(int rows, int nonzero_count){
+    return arena_size(sizeof(sparse_matrix)) + arena_size(sizeof(int) * (rows + 1))
+        + arena_size(sizeof(int) * nonzero_count) + arena_size(sizeof(double) * nonzero_count);
+}
+
+sparse_matrix * alloc_sparse_matrix(int rows, int nonzero_count){
+    sparse_matrix * matrix = arena_malloc(sizeof(sparse_matrix));
+    matrix->rows = rows;
+    matrix->nonzero_count = nonzero_count;
+    matrix->row_start = arena_malloc(sizeof(int) * (rows + 1));
+    matrix->col_index = arena_malloc(sizeof(int) * nonzero_count);
+    matrix->values = arena_malloc(sizeof(double) * nonzero_count);
+    return matrix;
+}
+
+void free_sparse_matrix(sparse_matrix * matrix){
+    if(matrix == NULL){
+        return;
+    }
+    arena_free(matrix->row_start);
+    arena_free(matrix->col_index);
+    arena_free(matrix->values);
+    arena_free(matrix);
+}
+
+static void rosenbrock_rates(double(*func)(double *, int), void(*derivatives)(double *, double *), double * vars, double * rates, int var_count){
+    // fills rates[i - 1] with the derivative of variable i, from whichever of
+    // func and derivatives isn't NULL.
+    int i;
+    if(derivatives != NULL){
+        derivatives(vars, rates);
+        return;
+    }
+    for(i=1;i<var_count;i++){
+        rates[i-1] = func(vars, i);
+    }
+}
+
+static void rosenbrock_evaluate_jacobian(double(*func)(double *, int), void(*derivatives)(double *, double *), double * vars_in, double * f0, double * temp, int var_count, int const_count){
+    // fills in the values of rosenbrock_jacobian at vars_in. Row i and column j
+    // refer to dependent variable i + 1 and j + 1 respectively.
+    int i, j, n, colour;
+    if(rosenbrock_user_jacobian != NULL){
+        rosenbrock_user_jacobian(vars_in, rosenbrock_jacobian);
+        return;
+    }
+
+    // no analytic Jacobian, so use forward differences. Only the entries in the
+    // sparsity pattern are evaluated, so a sparse pattern means fewer calls to func.
+    for(i=0;i<var_count + const_count;i++){
+        temp[i] = vars_in[i];
+    }
+    if(derivatives == NULL){
+        for(i=0;i<rosenbrock_jacobian->rows;i++){
+            for(n=rosenbrock_jacobian->row_start[i];n<rosenbrock_jacobian->row_start[i + 1];n++){
+                j = rosenbrock_jacobian->col_index[n] + 1;
+                double delta = sqrt(DBL_EPSILON) * fmax(fabs(vars_in[j]), 1);
+                temp[j] = vars_in[j] + delta;
+                // use the actual difference to cancel out some round-off
+                delta = temp[j] - vars_in[j];
+                rosenbrock_jacobian->values[n] = (func(temp, i + 1) - f0[i]) / delta;
+                temp[j] = vars_in[j];
+            }
+        }
+        return;
+    }
+
+    // the whole system is evaluated at once, so perturb every column of a
+    // colour together: no row depends on two of them, so each difference in
+    // the rates belongs to one column.
+    for(colour=0;colour<rosenbrock_colour_count;colour++){
+        for(j=0;j<rosenbrock_jacobian->rows;j++){
+            if(rosenbrock_colour[j] == colour){
+                temp[j + 1] = vars_in[j + 1] + sqrt(DBL_EPSILON) * fmax(fabs(vars_in[j + 1]), 1);
+            }
+        }
+        derivatives(temp, rosenbrock_perturbed);
+        for(j=0;j<rosenbrock_jacobian->rows;j++){
+            if(rosenbrock_colour[j] == colour){
+                double delta = temp[j + 1] - vars_in[j + 1];
+                for(n=rosenbrock_column_start[j];n<rosenbrock_column_start[j + 1];n++){
+                    i = rosenbrock_column_row[n];
+                    rosenbrock_jacobian->values[rosenbrock_column_entry[n]] = (rosenbrock_perturbed[i] - f0[i]) / delta;
+                }
+                temp[j + 1] = vars_in[j + 1];
+            }
+        }
+    }
+}
+
+static void int_heap_push(int * heap, int * count, int value){
+    int i = (*count)++;
+    while(i > 0 && heap[(i - 1) / 2] > value){
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = value;
+}
+
+static int int_heap_pop(int * heap, int * count){
+    // removes and returns the smallest value
+    int top = heap[0], last = heap[--(*count)];
+    int i = 0, child;
+    while((child = 2 * i + 1) < *count){
+        if(child + 1 < *count && heap[child + 1] < heap[child]){
+            child ++;
+        }
+        if(heap[child] >= last){
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+static int compare_ints(const void * a, const void * b){
+    return *(const int *)a - *(const int *)b;
+}
+
+static int rosenbrock_lu_pattern(sparse_matrix * pattern, int n, int ** lu_row_start, int ** lu_col_index, int ** lu_diagonal){
+    /*
+    Works out where the entries of the LU factors of W = I - gamma h J will
+    be, given the pattern of J (NULL for dense). Pivots are taken from the
+    diagonal, so this only has to be done once: row i has the entries of row
+    i of J, the diagonal, and those right of the diagonal in row k of U for
+    every k left of the diagonal in row i. The ks are taken smallest first
+    from a heap, so the cost goes with the number of entries rather than n
+    squared. The rows are sorted and, with the index of each diagonal, are
+    returned in memory from malloc(). Returns the number of entries.
+    */
+    int * marker = malloc(sizeof(int) * n);
+    int * heap = malloc(sizeof(int) * n);
+    int * row_start = malloc(sizeof(int) * (n + 1));
+    int * diagonal = malloc(sizeof(int) * n);
+    int capacity = pattern == NULL ? n * n : pattern->nonzero_count + n;
+    int * col_index = malloc(sizeof(int) * capacity);
+    int i, j, k, p, count = 0, heap_count;
+
+    for(j=0;j<n;j++){
+        marker[j] = -1;
+    }
+    for(i=0;i<n;i++){
+        // a row has at most n entries, so make room for them up front
+        if(capacity - count < n){
+            capacity = 2 * capacity + n;
+            col_index = realloc(col_index, sizeof(int) * capacity);
+        }
+        row_start[i] = count;
+        heap_count = 0;
+        marker[i] = i;
+        col_index[count++] = i;
+        for(p=(pattern == NULL ? 0 : pattern->row_start[i]);p<(pattern == NULL ? n : pattern->row_start[i + 1]);p++){
+            j = pattern == NULL ? p : pattern->col_index[p];
+            if(marker[j] != i){
+                marker[j] = i;
+                col_index[count++] = j;
+                if(j < i){
+                    int_heap_push(heap, &heap_count, j);
+                }
+            }
+        }
+        // fill in. Anything added is right of k, so is popped later.
+        while(heap_count > 0){
+            k = int_heap_pop(heap, &heap_count);
+            for(p=diagonal[k]+1;p<row_start[k + 1];p++){
+                j = col_index[p];
+                if(marker[j] != i){
+                    marker[j] = i;
+                    col_index[count++] = j;
+                    if(j < i){
+                        int_heap_push(heap, &heap_count, j);
+                    }
+                }
+            }
+        }
+        qsort(&(col_index[row_start[i]]), count - row_start[i], sizeof(int), &compare_ints);
+        for(p=row_start[i];col_index[p]!=i;p++);
+        diagonal[i] = p;
+    }
+    row_start[n] = count;
+
+    free(marker);
+    free(heap);
+    *lu_row_start = row_start;
+    *lu_col_index = col_index;
+    *lu_diagonal = diagonal;
+    return count;
+}
+
+static void rosenbrock_factorise(double step, double * row){
+    // fills in W = I - gamma * step * J on the pattern from set_up_rosenbrock_2nd()
+    // and LU factorises it a row at a time, using row (n long) to work in.
+    sparse_matrix * lu = rosenbrock_lu;
+    int n = lu->rows;
+    int i, k, p, q;
+    for(i=0;i<n;i++){
+        for(p=lu->row_start[i];p<lu->row_start[i + 1];p++){
+            row[lu->col_index[p]] = 0;
+        }
+        row[i] = 1;
+        for(p=rosenbrock_jacobian->row_start[i];p<rosenbrock_jacobian->row_start[i + 1];p++){
+            row[rosenbrock_jacobian->col_index[p]] -= ROSENBROCK_GAMMA * step * rosenbrock_jacobian->values[p];
+        }
+
+        // eliminate using the rows of U above, in order
+        for(p=lu->row_start[i];p<rosenbrock_diagonal[i];p++){
+            k = lu->col_index[p];
+            double factor = row[k] / lu->values[rosenbrock_diagonal[k]];
+            row[k] = factor;
+            if(factor != 0){
+                for(q=rosenbrock_diagonal[k]+1;q<lu->row_start[k + 1];q++){
+                    row[lu->col_index[q]] -= factor * lu->values[q];
+                }
+            }
+        }
+        if(row[i] == 0){
+            // singular, which only happens for a degenerate Jacobian. Leaving the
+            // row alone is equivalent to an explicit step for that variable.
+            row[i] = 1;
+        }
+
+        for(p=lu->row_start[i];p<lu->row_start[i + 1];p++){
+            lu->values[p] = row[lu->col_index[p]];
+        }
+    }
+}
+
+static void rosenbrock_solve(double * x){
+    // solves W x = b in place using the factorisation from rosenbrock_factorise()
+    sparse_matrix * lu = rosenbrock_lu;
+    int n = lu->rows;
+    int i, p;
+    for(i=1;i<n;i++){
+        for(p=lu->row_start[i];p<rosenbrock_diagonal[i];p++){
+            x[i] -= lu->values[p] * x[lu->col_index[p]];
+        }
+    }
+    for(i=n-1;i>=0;i--){
+        for(p=rosenbrock_diagonal[i]+1;p<lu->row_start[i + 1];p++){
+            x[i] -= lu->values[p] * x[lu->col_index[p]];
+        }
+        x[i] /= lu->values[rosenbrock_diagonal[i]];
+    }
+}
+
+static void rosenbrock_2nd_step(double(*func)(double *, int), void(*derivatives)(double *, double *), double * vars_in, double * vars_out, int var_count, int const_count, double step){
+    // rosenbrock_2nd() and rosenbrock_2nd_system(), with the rates from whichever
+    // of func and derivatives isn't NULL.
+    int n = var_count - 1;
+    double * temp = rosenbrock_pool;
+    double * f0 = &(rosenbrock_pool[var_count + const_count]);
+    double * k1 = &(rosenbrock_pool[var_count + const_count + n]);
+    double * k2 = &(rosenbrock_pool[var_count + const_count + 2 * n]);
+    double * row = &(rosenbrock_pool[var_count + const_count + 3 * n]);
+    double * ft = &(rosenbrock_pool[var_count + const_count + 4 * n]);
+
+    int i;
+    for(i=var_count;i<const_count + var_count;i++){
+        vars_out[i] = vars_in[i];
+        temp[i] = vars_in[i];
+    }
+
+    rosenbrock_rates(func, derivatives, vars_in, f0, var_count);
+
+    if(rosenbrock_age == 0){
+        rosenbrock_evaluate_jacobian(func, derivatives, vars_in, f0, temp, var_count, const_count);
+        rosenbrock_factorise(step, row);
+        rosenbrock_factored_step = step;
+    }else if(step != rosenbrock_factored_step){
+        rosenbrock_factorise(step, row);
+        rosenbrock_factored_step = step;
+    }
+    rosenbrock_age = (rosenbrock_age + 1) % ROSENBROCK_JACOBIAN_AGE;
+
+    // gamma h df/dt, which is zero for an autonomous system
+    for(i=0;i<n;i++){
+        ft[i] = 0;
+    }
+    if(!rosenbrock_autonomous){
+        for(i=1;i<var_count;i++){
+            temp[i] = vars_in[i];
+        }
+        temp[0] = vars_in[0] + sqrt(DBL_EPSILON) * fmax(fabs(vars_in[0]), fabs(step));
+        double delta = temp[0] - vars_in[0];
+        rosenbrock_rates(func, derivatives, temp, ft, var_count);
+        for(i=0;i<n;i++){
+            ft[i] = ROSENBROCK_GAMMA * step * (ft[i] - f0[i]) / delta;
+        }
+    }
+
+    // k1
+    for(i=0;i<n;i++){
+        k1[i] = f0[i] + ft[i];
+    }
+    rosenbrock_solve(k1);
+
+    // k2
+    temp[0] = vars_in[0] + step;
+    for(i=1;i<var_count;i++){
+        temp[i] = vars_in[i] + step * k1[i-1];
+    }
+    rosenbrock_rates(func, derivatives, temp, k2, var_count);
+    for(i=0;i<n;i++){
+        k2[i] -= 2 * k1[i] + ft[i];
+    }
+    rosenbrock_solve(k2);
+
+    for(i=1;i<var_count;i++){
+        vars_out[i] = vars_in[i] + step * (1.5 * k1[i-1] + .5 * k2[i-1]);
+    }
+
+    vars_out[0] = vars_in[0] + step;
+}
+
+void rosenbrock_2nd(double(*func)(double *, int), double * vars_in, double * vars_out, int var_count, int const_count, double step){
+    /*
+    A linearly implicit (Rosenbrock-W) method for stiff systems, called in the
+    same way as runge_kutta_4th(). Each step solves
+        (I - gamma h J) k1 = f(t, y) + gamma h df/dt
+        (I - gamma h J) k2 = f(t + h, y + h k1) - 2 k1 - gamma h df/dt
+        y' = y + 3/2 h k1 + 1/2 h k2
+    which is second order for any J, so the Jacobian and its LU factorisation
+    are kept for ROSENBROCK_JACOBIAN_AGE steps (or until the step changes)
+    rather than being rebuilt every step. It is L-stable, so the step is
+    limited by accuracy rather than stability. df/dt is found by a forward
+    difference in vars_in[0] each step, unless set_up_rosenbrock_2nd() was
+    told the system is autonomous.
+
+    set_up_rosenbrock_2nd() must be called first.
+    */
+    rosenbrock_2nd_step(func, NULL, vars_in, vars_out, var_count, const_count, step);
+}
+
+void rosenbrock_2nd_system(void(*derivatives)(double *, double *), double * vars_in, double * vars_out, int var_count, int const_count, double step){
+    /*
+    The same as rosenbrock_2nd(), except that the whole system is evaluated in
+    one call, as for runge_kutta_4th_system(). Without an analytic Jacobian
+    the finite differences perturb a group of columns at once, so the calls
+    per Jacobian go with how many variables each rate depends on rather than
+    with the size of the system.
+
+    set_up_rosenbrock_2nd_system() must be called first.
+    */
+    rosenbrock_2nd_step(NULL, derivatives, vars_in, vars_out, var_count, const_count, step);
+}
+
+size_t rosenbrock_2nd_size(int variable_count, int constant_count, sparse_matrix * pattern){
+    // pattern is as for set_up_rosenbrock_2nd(). This works out the fill in of
+    // the LU factors to size them, so costs as much as setting up.
+    int n = variable_count - 1;
+    int * lu_row_start, * lu_col_index, * lu_diagonal;
+    int lu_count = rosenbrock_lu_pattern(pattern, n, &lu_row_start, &lu_col_index, &lu_diagonal);
+    free(lu_row_start);
+    free(lu_col_index);
+    free(lu_diagonal);
+    return sparse_matrix_size(n, pattern == NULL ? n * n : pattern->nonzero_count)
+        + arena_size(sizeof(double) * (5 * n + constant_count + variable_count))
+        + sparse_matrix_size(n, lu_count) + arena_size(sizeof(int) * n);
+}
+
+size_t rosenbrock_2nd_system_size(int variable_count, int constant_count, sparse_matrix * pattern){
+    int n = variable_count - 1;
+    int nonzero_count = pattern == NULL ? n * n : pattern->nonzero_count;
+    return rosenbrock_2nd_size(variable_count, constant_count, pattern) + 2 * arena_size(sizeof(int) * (n + 1))
+        + 2 * arena_size(sizeof(int) * nonzero_count) + arena_size(sizeof(double) * n);
+}
+
+void set_up_rosenbrock_2nd(int variable_count, int constant_count, sparse_matrix * pattern, void(*jacobian)(double *, sparse_matrix *), int autonomous){
+    /*
+    pattern gives the sparsity of the Jacobian df_i/dy_j over the dependent
+    variables (row/column 0 is variable 1). It is copied, so the caller keeps
+    ownership of it. If pattern is NULL the Jacobian is treated as dense.
+
+    jacobian, if not NULL, is called to fill in the values of a matrix with the
+    given pattern. Otherwise the Jacobian is found by finite differences, one
+    call to the system's function for each entry in the pattern.
+
+    autonomous should be nonzero if the system's function doesn't depend on
+    the time (vars[0]), which saves a call per variable each step.
+
+    W is factorised with pivots on the diagonal, so that where its entries
+    (including fill in) will be is worked out here once. Its diagonal is 1
+    less gamma h times J's, which for the decaying modes of stiff systems only
+    grows, so this is safe for the problems the method is meant for.
+    */
+    int n = variable_count - 1;
+    int i, j;
+    if(pattern == NULL){
+        rosenbrock_jacobian = alloc_sparse_matrix(n, n * n);
+        for(i=0;i<n;i++){
+            rosenbrock_jacobian->row_start[i] = i * n;
+            for(j=0;j<n;j++){
+                rosenbrock_jacobian->col_index[i * n + j] = j;
+            }
+        }
+        rosenbrock_jacobian->row_start[n] = n * n;
+    }else{
+        rosenbrock_jacobian = alloc_sparse_matrix(n, pattern->nonzero_count);
+        memcpy(rosenbrock_jacobian->row_start, pattern->row_start, sizeof(int) * (n + 1));
+        memcpy(rosenbrock_jacobian->col_index, pattern->col_index, sizeof(int) * pattern->nonzero_count);
+    }
+    rosenbrock_user_jacobian = jacobian;
+
+    int * lu_row_start, * lu_col_index, * lu_diagonal;
+    int lu_count = rosenbrock_lu_pattern(pattern, n, &lu_row_start, &lu_col_index, &lu_diagonal);
+    rosenbrock_lu = alloc_sparse_matrix(n, lu_count);
+    memcpy(rosenbrock_lu->row_start, lu_row_start, sizeof(int) * (n + 1));
+    memcpy(rosenbrock_lu->col_index, lu_col_index, sizeof(int) * lu_count);
+    rosenbrock_diagonal = arena_malloc(sizeof(int) * n);
+    memcpy(rosenbrock_diagonal, lu_diagonal, sizeof(int) * n);
+    free(lu_row_start);
+    free(lu_col_index);
+    free(lu_diagonal);
+
+    // a temporary copy of the variables, then f(y), k1, k2, a row of W to
+    // factorise in and gamma h df/dt.
+    rosenbrock_pool = arena_malloc(sizeof(double) * (5 * n + constant_count + variable_count));
+    rosenbrock_age = 0;
+    rosenbrock_autonomous = autonomous;
+}
+
+void set_up_rosenbrock_2nd_system(int variable_count, int constant_count, sparse_matrix * pattern, void(*jacobian)(double *, sparse_matrix *), int autonomous){
+    /*
+    As set_up_rosenbrock_2nd(), for rosenbrock_2nd_system(). Without jacobian,
+    the columns of the pattern are coloured so that no row has entries in two
+    columns of the same colour, which takes a pass over the rows each column
+    is in. The columns are found greedily in order, so a pattern from nodes
+    along a space-filling curve needs few colours.
+    */
+    int n = variable_count - 1;
+    int i, j, k, p, q, colour;
+    set_up_rosenbrock_2nd(variable_count, constant_count, pattern, jacobian, autonomous);
+    if(jacobian != NULL){
+        return;
+    }
+
+    // the pattern by columns: the row each entry is in, and where it is in
+    // rosenbrock_jacobian
+    sparse_matrix * rows = rosenbrock_jacobian;
+    rosenbrock_column_start = arena_malloc(sizeof(int) * (n + 1));
+    rosenbrock_column_row = arena_malloc(sizeof(int) * rows->nonzero_count);
+    rosenbrock_column_entry = arena_malloc(sizeof(int) * rows->nonzero_count);
+    for(j=0;j<=n;j++){
+        rosenbrock_column_start[j] = 0;
+    }
+    for(p=0;p<rows->nonzero_count;p++){
+        rosenbrock_column_start[rows->col_index[p] + 1] ++;
+    }
+    for(j=0;j<n;j++){
+        rosenbrock_column_start[j + 1] += rosenbrock_column_start[j];
+    }
+    int * fill = malloc(sizeof(int) * n);
+    memcpy(fill, rosenbrock_column_start, sizeof(int) * n);
+    for(i=0;i<n;i++){
+        for(p=rows->row_start[i];p<rows->row_start[i + 1];p++){
+            q = fill[rows->col_index[p]]++;
+            rosenbrock_column_row[q] = i;
+            rosenbrock_column_entry[q] = p;
+        }
+    }
+
+    // fill now marks, for each colour, the last column found unable to use it
+    rosenbrock_colour = arena_malloc(sizeof(int) * n);
+    rosenbrock_colour_count = 0;
+    for(j=0;j<n;j++){
+        fill[j] = -1;
+        rosenbrock_colour[j] = -1;
+    }
+    for(j=0;j<n;j++){
+        for(p=rosenbrock_column_start[j];p<rosenbrock_column_start[j + 1];p++){
+            i = rosenbrock_column_row[p];
+            for(q=rows->row_start[i];q<rows->row_start[i + 1];q++){
+                k = rows->col_index[q];
+                if(rosenbrock_colour[k] >= 0){
+                    fill[rosenbrock_colour[k]] = j;
+                }
+            }
+        }
+        for(colour=0;fill[colour]==j;colour++);
+        rosenbrock_colour[j] = colour;
+        if(colour == rosenbrock_colour_count){
+            rosenbrock_colour_count ++;
+        }
+    }
+    free(fill);
+
+    rosenbrock_perturbed = arena_malloc(sizeof(double) * n);
+}
+
+void free_rosenbrock_2nd(){
+    // as with free_runge_kutta_4th(), call this between simulations.
+    free_sparse_matrix(rosenbrock_jacobian);
+    free_sparse_matrix(rosenbrock_lu);
+    arena_free(rosenbrock_pool);
+    arena_free(rosenbrock_diagonal);
+    arena_free(rosenbrock_column_start);
+    arena_free(rosenbrock_column_row);
+    arena_free(rosenbrock_column_entry);
+    arena_free(rosenbrock_colour);
+    arena_free(rosenbrock_perturbed);
+    rosenbrock_jacobian = NULL;
+    rosenbrock_column_start = NULL;
+    rosenbrock_column_row = NULL;
+    rosenbrock_column_entry = NULL;
+    rosenbrock_colour = NULL;
+    rosenbrock_perturbed = NULL;
+    rosenbrock_lu = NULL;
+    rosenbrock_user_jacobian = NULL;
+}
+
+static void propagate(int(*iter_func)(double *, double *, double), double * state, double * scratch, int variable_count, double end_time, double step, FILE * fout){
+    // steps state up to exactly end_time, shortening the last step if needed.
+    // Rows are written for every state before end_time, as in iterate_to_file().
+    while(end_time - state[0] > step * 1E-9){
+        double h = end_time - state[0] < step ? end_time - state[0] : step;
+        if(fout != NULL){
+            write_row(fout, state, variable_count);
+        }
+        iter_func(state, scratch, h);
+        memcpy(state, scratch, sizeof(double) * variable_count);
+    }
+    state[0] = end_time;
+}
+
+typedef struct {
+    int(*iter_func)(double *, double *, double);
+    int variable_count;
+    int step_variable_count;
+    int step_constant_count;
+    double * start;
+    double * end;
+    double end_time;
+    double step;
+    double * scratch;
+    FILE * fout;
+    // set (under lock) to ask for a fine pass, and cleared when it is done.
+    // changed is signalled both ways.
+    int pending;
+    int quit;
+    pthread_mutex_t * lock;
+    pthread_cond_t * changed;
+    // the worker's own arena, for its pool
+    arena memory;
+} parareal_chunk;
+
+static void * parareal_fine_worker(void * arg){
+    // does a fine pass over its chunk each time one is asked for, until told
+    // to quit. The thread lives for the whole run, so its pool is only set up once.
+    parareal_chunk * chunk = arg;
+    use_arena(&(chunk->memory));
+    set_up_runge_kutta_4th(chunk->step_variable_count, chunk->step_constant_count);
+
+    pthread_mutex_lock(chunk->lock);
+    while(1){
+        while(!chunk->pending && !chunk->quit){
+            pthread_cond_wait(chunk->changed, chunk->lock);
+        }
+        if(!chunk->pending){
+            break;
+        }
+        pthread_mutex_unlock(chunk->lock);
+
+        // the output of the previous iteration is thrown away
+        rewind(chunk->fout);
+        ftruncate(fileno(chunk->fout), 0);
+        memcpy(chunk->end, chunk->start, sizeof(double) * chunk->variable_count);
+        propagate(chunk->iter_func, chunk->end, chunk->scratch, chunk->variable_count, chunk->end_time, chunk->step, chunk->fout);
+
+        pthread_mutex_lock(chunk->lock);
+        chunk->pending = 0;
+        pthread_cond_broadcast(chunk->changed);
+    }
+    pthread_mutex_unlock(chunk->lock);
+
+    free_runge_kutta_4th();
+    return NULL;
+}
+
+int parareal_to_file(int(*iter_func)(double *, double *, double), int variable_count, int step_variable_count, int step_constant_count, double * starting_values, double end_time, double fine_step, double coarse_step, int chunk_count, double tolerance, char ** variable_labels, FILE * fout){
+    /*
+    Parallel-in-time version of iterate_to_file() for long runs of small
+    systems. The time span is split into chunk_count chunks and then:
+        U[k+1] = G(U[k]) + F(U[k]) - G_old(U[k])
+    where G is iter_func run serially with coarse_step and F is iter_func run
+    on every chunk at once (one thread each) with fine_step. This repeats until
+    no chunk's starting state moves by more than tolerance (relative), which
+    takes at most chunk_count iterations. The rows written are those of the
+    last fine pass, so the file looks the same as one from iterate_to_file().
+
+    iter_func must step with runge_kutta_4th(); step_variable_count and
+    step_constant_count are what would be passed to set_up_runge_kutta_4th(),
+    which must already have been called for this thread. Returns the number of
+    iterations taken. The fine passes are done by one thread per chunk, started
+    once for the whole run. All of the memory, including each thread's pool,
+    comes from the arena in use; parareal_to_file_size() says how much.
+    */
+    if(fout == NULL){
+        return 0;
+    }
+
+    int i, k, iteration;
+    write_labels(fout, variable_labels, variable_count);
+
+    // line the chunks up with whole fine steps so that rows land on the same
+    // times as a serial run
+    double span = end_time - starting_values[0];
+    double steps_per_chunk = ceil(ceil(span / fine_step - 1E-9) / chunk_count);
+    if(steps_per_chunk < 1){
+        steps_per_chunk = 1;
+    }
+    double chunk_length = steps_per_chunk * fine_step;
+    chunk_count = (int)ceil(span / chunk_length - 1E-9);
+    if(chunk_count < 1){
+        chunk_count = 1;
+    }
+    if(coarse_step > chunk_length){
+        coarse_step = chunk_length;
+    }
+
+    // U, the starting state of each chunk (and the end of the last one),
+    // G_old, the coarse result for each chunk from the previous iteration, and
+    // the fine result for each chunk.
+    double * u = arena_malloc(sizeof(double) * variable_count * (chunk_count + 1));
+    double * coarse = arena_malloc(sizeof(double) * variable_count * chunk_count);
+    double * fine = arena_malloc(sizeof(double) * variable_count * chunk_count);
+    double * fine_start = arena_malloc(sizeof(double) * variable_count * chunk_count);
+    double * scratch = arena_malloc(sizeof(double) * variable_count);
+    double * g = arena_malloc(sizeof(double) * variable_count);
+    double * fine_scratch = arena_malloc(sizeof(double) * variable_count * chunk_count);
+    parareal_chunk * chunks = arena_malloc(sizeof(parareal_chunk) * chunk_count);
+    pthread_t * threads = arena_malloc(sizeof(pthread_t) * chunk_count);
+    int * stale = arena_malloc(sizeof(int) * chunk_count);
+    char * buffers = arena_malloc(BUFSIZ * chunk_count);
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&changed, NULL);
+
+    // initial coarse sweep
+    memcpy(u, starting_values, sizeof(double) * variable_count);
+    for(k=0;k<chunk_count;k++){
+        double * next = &(u[(k + 1) * variable_count]);
+        memcpy(next, &(u[k * variable_count]), sizeof(double) * variable_count);
+        propagate(iter_func, next, scratch, variable_count,
+            k + 1 == chunk_count ? end_time : starting_values[0] + (k + 1) * chunk_length, coarse_step, NULL);
+        memcpy(&(coarse[k * variable_count]), next, sizeof(double) * variable_count);
+
+        chunks[k].iter_func = iter_func;
+        chunks[k].variable_count = variable_count;
+        chunks[k].step_variable_count = step_variable_count;
+        chunks[k].step_constant_count = step_constant_count;
+        chunks[k].start = &(fine_start[k * variable_count]);
+        chunks[k].end = &(fine[k * variable_count]);
+        chunks[k].end_time = k + 1 == chunk_count ? end_time : starting_values[0] + (k + 1) * chunk_length;
+        chunks[k].step = fine_step;
+        chunks[k].scratch = &(fine_scratch[k * variable_count]);
+        chunks[k].fout = tmpfile();
+        chunks[k].pending = 0;
+        chunks[k].quit = 0;
+        chunks[k].lock = &lock;
+        chunks[k].changed = &changed;
+        split_arena(&(chunks[k].memory), runge_kutta_4th_size(step_variable_count, step_constant_count));
+        stale[k] = 1;
+        if(chunks[k].fout == NULL){
+            printf("Could not create a temporary file for parareal output.\n");
+            exit(1);
+        }
+        setvbuf(chunks[k].fout, &(buffers[k * BUFSIZ]), _IOFBF, BUFSIZ);
+    }
+    for(k=0;k<chunk_count;k++){
+        pthread_create(&(threads[k]), NULL, &parareal_fine_worker, &(chunks[k]));
+    }
+
+    #ifdef COUNT_ALLOCATIONS
+    long allocations_after_first_step = -1;
+    #endif
+
+    for(iteration=1;iteration<=chunk_count;iteration++){
+        // fine pass over every chunk whose starting state has changed. Chunks
+        // before the first changed one are already exact.
+        pthread_mutex_lock(&lock);
+        for(k=0;k<chunk_count;k++){
+            if(stale[k]){
+                memcpy(chunks[k].start, &(u[k * variable_count]), sizeof(double) * variable_count);
+                chunks[k].pending = 1;
+            }
+        }
+        pthread_cond_broadcast(&changed);
+        for(k=0;k<chunk_count;k++){
+            while(chunks[k].pending){
+                pthread_cond_wait(&changed, &lock);
+            }
+        }
+        pthread_mutex_unlock(&lock);
+
+        // serial correction sweep
+        double change = 0;
+        for(k=0;k<chunk_count;k++){
+            double * start = &(u[k * variable_count]);
+            double * next = &(u[(k + 1) * variable_count]);
+            memcpy(g, start, sizeof(double) * variable_count);
+            propagate(iter_func, g, scratch, variable_count, chunks[k].end_time, coarse_step, NULL);
+            for(i=1;i<variable_count;i++){
+                double corrected = g[i] + fine[k * variable_count + i] - coarse[k * variable_count + i];
+                double difference = fabs(corrected - next[i]) / fmax(fabs(corrected), 1);
+                if(difference > change){
+                    change = difference;
+                }
+                next[i] = corrected;
+            }
+            memcpy(&(coarse[k * variable_count]), g, sizeof(double) * variable_count);
+            if(k + 1 < chunk_count){
+                stale[k + 1] = memcmp(next, chunks[k + 1].start, sizeof(double) * variable_count) != 0;
+            }
+        }
+        stale[0] = 0;
+
+        #ifdef COUNT_ALLOCATIONS
+        if(allocations_after_first_step < 0){
+            allocations_after_first_step = allocation_count;
+        }
+        #endif
+        if(change <= tolerance){
+            break;
+        }
+    }
+    if(iteration > chunk_count){
+        iteration = chunk_count;
+    }
+    if(iteration == chunk_count && chunk_count > 1){
+        // the last chunk has then had one fine pass per chunk before it, as
+        // many as a serial run, so nothing was gained
+        fprintf(stderr, "Parareal took one iteration per chunk (%d), so was no faster than a serial run.\n", chunk_count);
+    }
+
+    #ifdef COUNT_ALLOCATIONS
+    check_allocations("parareal_to_file()", allocations_after_first_step);
+    #endif
+    pthread_mutex_lock(&lock);
+    for(k=0;k<chunk_count;k++){
+        chunks[k].quit = 1;
+    }
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+    for(k=0;k<chunk_count;k++){
+        pthread_join(threads[k], NULL);
+    }
+    pthread_mutex_destroy(&lock);
+    pthread_cond_destroy(&changed);
+
+    // the rows from the last fine pass, in order
+    char buffer[BUFSIZ];
+    for(k=0;k<chunk_count;k++){
+        size_t read;
+        rewind(chunks[k].fout);
+        while((read = fread(buffer, 1, sizeof(buffer), chunks[k].fout)) > 0){
+            fwrite(buffer, 1, read, fout);
+        }
+        fclose(chunks[k].fout);
+        arena_free(chunks[k].memory.base);
+    }
+    write_row(fout, &(fine[(chunk_count - 1) * variable_count]), variable_count);
+
+    arena_free(u);
+    arena_free(coarse);
+    arena_free(fine);
+    arena_free(fine_start);
+    arena_free(scratch);
+    arena_free(g);
+    arena_free(fine_scratch);
+    arena_free(chunks);
+    arena_free(threads);
+    arena_free(stale);
+    arena_free(buffers);
+    return iteration;
+}
+
+size_t parareal_to_file_size(int variable_count, int step_variable_count, int step_constant_count, int chunk_count){
+    // what parareal_to_file() takes from the arena, at most
+    return arena_size(sizeof(double) * variable_count * (chunk_count + 1)) + 4 * arena_size(sizeof(double) * variable_count * chunk_count)
+        + 2 * arena_size(sizeof(double) * variable_count) + arena_size(sizeof(parareal_chunk) * chunk_count)
+        + arena_size(sizeof(pthread_t) * chunk_count) + arena_size(sizeof(int) * chunk_count) + arena_size(BUFSIZ * chunk_count)
+        + chunk_count * arena_size(runge_kutta_4th_size(step_variable_count, step_constant_count));
 }
 
 int process_flags(int argc, char ** args, int flagnc, char ** flagns){
@@ -9,6 +9,20 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
+
+// uncomment (or compile with -DCOUNT_ALLOCATIONS) to count every heap
+// allocation in the process, so that each stepping loop (iterate_to_file(),
+// parareal_to_file() and the --distributed workers and writer) can check that
+// none are made once its first step is done. malloc(), calloc() and realloc()
+// are replaced for the whole program, so those made inside the C library (ie,
+// by fopen()) are counted too. This relies on glibc.
+//#define COUNT_ALLOCATIONS
+
+#ifdef COUNT_ALLOCATIONS
+extern long allocation_count;
+void check_allocations(char * loop, long after_first_step);
+#endif
 
 #define CONTINUE_ITERATING 0
 #define STOP_ITERATING 1
@@ -18,13 +32,118 @@
 #define FLAG_CENTRAL 4
 #define FLAG_VARY_DRAG 8
 
-static double * variable_pool = NULL;
+// parareal_to_file() defaults: the coarse step as a multiple of the fine one,
+// and the relative change between iterations at which it stops. main.c lets
+// $SIMULATOR_PARAREAL_COARSE_RATIO and $SIMULATOR_PARAREAL_TOLERANCE override them.
+#define PARAREAL_COARSE_RATIO 100
+#define PARAREAL_TOLERANCE 1E-10
+
+// arena allocations are rounded up to this so that no two share a cache line
+#define CACHE_LINE_SIZE 64
+// a little extra room in each run's arena for small things (ie, events)
+#define ARENA_SLACK 65536
+// size of the output buffer taken from the arena
+#define OUTPUT_BUFFER_SIZE 65536
+
+// default relative error per step for bulirsch_stoer()
+#define BULIRSCH_STOER_TOLERANCE 1E-13
+
+/*
+A sparse matrix in compressed sparse row (CSR) form. The columns used by
+row i are col_index[row_start[i]] to col_index[row_start[i + 1] - 1], with
+the matching entries in values.
+*/
+typedef struct {
+    int rows;
+    int nonzero_count;
+    int * row_start;
+    int * col_index;
+    double * values;
+} sparse_matrix;
+
+// what to do when an event happens. These can be combined.
+#define EVENT_LOG 1
+#define EVENT_STOP 2
+#define EVENT_REDUCE_STEP 4
+#define EVENT_CHECKPOINT 8
+
+// which sign changes count as an event
+#define EVENT_ANY 0
+#define EVENT_RISING 1
+#define EVENT_FALLING -1
+
+// how closely (as a fraction of the step) an event's time is found
+#define EVENT_TOLERANCE 1E-12
+
+/*
+An event happens when function(vars) changes sign in the given direction.
+EVENT_LOG writes the name and state to the event log, EVENT_REDUCE_STEP
+shortens the step so that a row is written at the event, EVENT_STOP makes
+that row the last one and EVENT_CHECKPOINT writes the labels and state to
+the checkpoint file. Only the signs at either end of a step are compared,
+so the step must be shorter than the time between two events. The time of
+the event is found on an interpolant of the step, and the state written for
+it (and carried on from, for EVENT_REDUCE_STEP) is the interpolated one. The
+interpolant is a cubic through the ends of the step unless the step method
+has a dense output (see set_event_dense_output()); over a long step (ie, the
+output interval of bulirsch_stoer()) the cubic can be well out.
+*/
+typedef struct {
+    char * name;
+    double(*function)(double *);
+    int direction;
+    int actions;
+} event;
+
+/*
+A block of memory for everything one run needs, sized up front and handed
+out in cache line aligned pieces which are never freed on their own. See
+use_arena().
+*/
+typedef struct {
+    char * base;
+    size_t size;
+    size_t used;
+} arena;
+
+typedef void(*step_method)(double(*func)(double *, int), double * vars_in, double * vars_out, int var_count, int const_count, double step);
+typedef void(*system_step_method)(void(*derivatives)(double *, double *), double * vars_in, double * vars_out, int var_count, int const_count, double step);
 
+arena * create_arena(size_t size, int huge_pages);
+void free_arena(arena * a);
+void * arena_alloc(arena * a, size_t bytes);
+size_t arena_size(size_t bytes);
+void use_arena(arena * a);
+void * arena_malloc(size_t bytes);
+void arena_free(void * pointer);
+size_t iterate_to_file_size(int variable_count);
+size_t runge_kutta_4th_size(int variable_count, int constant_count);
+size_t rosenbrock_2nd_size(int variable_count, int constant_count, sparse_matrix * pattern);
+size_t rosenbrock_2nd_system_size(int variable_count, int constant_count, sparse_matrix * pattern);
+size_t bulirsch_stoer_size(int variable_count, int constant_count);
+size_t sparse_matrix_size(int rows, int nonzero_count);
+size_t parareal_to_file_size(int variable_count, int step_variable_count, int step_constant_count, int chunk_count);
 void iterate_to_file(int(*iter_func)(double *, double *, double), int variable_count, double * starting_values, double independent_variable_step, char ** variable_labels, FILE * fout);
+void set_up_events(event * events, int event_count, double(*system)(double *, int), int system_variable_count, FILE * event_log, char * checkpoint_path);
+void set_event_dense_output(int(*dense_output)(double, double *));
+void free_events();
+int parareal_to_file(int(*iter_func)(double *, double *, double), int variable_count, int step_variable_count, int step_constant_count, double * starting_values, double end_time, double fine_step, double coarse_step, int chunk_count, double tolerance, char ** variable_labels, FILE * fout);
 int process_flags(int argc, char ** args, int flagnc, char ** flagns);
 int process_numeric_args(int argc, char ** args, double * processed_args);
 void runge_kutta_4th(double(*func)(double *, int), double * vars_in, double * vars_out, int var_count, int const_count, double step);
+void runge_kutta_4th_system(void(*derivatives)(double *, double *), double * vars_in, double * vars_out, int var_count, int const_count, double step);
 void set_up_runge_kutta_4th(int variable_count, int constant_count);
 void free_runge_kutta_4th();
+void rosenbrock_2nd(double(*func)(double *, int), double * vars_in, double * vars_out, int var_count, int const_count, double step);
+void set_up_rosenbrock_2nd(int variable_count, int constant_count, sparse_matrix * pattern, void(*jacobian)(double *, sparse_matrix *), int autonomous);
+void rosenbrock_2nd_system(void(*derivatives)(double *, double *), double * vars_in, double * vars_out, int var_count, int const_count, double step);
+void set_up_rosenbrock_2nd_system(int variable_count, int constant_count, sparse_matrix * pattern, void(*jacobian)(double *, sparse_matrix *), int autonomous);
+void free_rosenbrock_2nd();
+void bulirsch_stoer(double(*func)(double *, int), double * vars_in, double * vars_out, int var_count, int const_count, double step);
+void set_up_bulirsch_stoer(int variable_count, int constant_count, double tolerance);
+int bulirsch_stoer_dense_output(double time, double * state);
+void free_bulirsch_stoer();
+sparse_matrix * alloc_sparse_matrix(int rows, int nonzero_count);
+void free_sparse_matrix(sparse_matrix * matrix);
 
 #endif
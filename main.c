@@ -5,6 +5,9 @@
 
 #include "main.h"
 
+// everything a run needs comes from here. See set_up_run_arena().
+static arena * run_arena = NULL;
+
 void help(){
     printf("Usage:\n");
     printf("    simulator [filepath] --flag1 --flag2... var1 var2 var3...\n\n");
@@ -24,6 +27,20 @@ void help(){
     printf("        Writes to the standard out (ie, the command line) \n        rather than a physical file. In this case a filepath \n        does not need to be set. \n        Useful for visulaising simulations 'live'.\n");
     printf("    --resume\n");
     printf("        Resumes an existing simulation. The file specified \n        is appended to rather than overwritten (unless --stdout\n        is specified). The only numerical argument required is then the time step.\n");
+    printf("    --implicit\n");
+    printf("        Uses a linearly implicit (Rosenbrock) method instead of \n        4th order Runge-Kutta. Stays stable for stiff systems \n        (such as stiff --network springs) at much larger time \n        steps.\n");
+    printf("    --network\n");
+    printf("        Simulates a rectangular mesh of masses joined by damped \n        springs (cloth in --3D). Numeric arguments are: start time, \n        columns, rows, spacing, spring rest length, node mass, \n        spring stiffness, spring damping, time limit, time step. \n        Of the other methods, only --implicit can be used.\n");
+    printf("    --parareal\n");
+    printf("        Splits the run into one chunk of time per core and \n        integrates them in parallel, correcting with a coarse \n        serial pass until they agree (orbits only). Only useful \n        for long runs of a few bodies. $SIMULATOR_PARAREAL_CHUNKS, \n        $SIMULATOR_PARAREAL_COARSE_RATIO (coarse step over time \n        step, default 100) and $SIMULATOR_PARAREAL_TOLERANCE \n        (default 1E-10) change the chunk count, coarse step and \n        when the chunks agree. The iterations taken are written to \n        the standard error. If the coarse pass is too poor to \n        converge, it takes one iteration per chunk and is slower \n        than a serial run; try a smaller coarse ratio.\n");
+    printf("    --bulirsch-stoer\n");
+    printf("        Uses Bulirsch-Stoer extrapolation instead of 4th order \n        Runge-Kutta (orbits only), for near machine precision. \n        The time step is then only the output interval.\n");
+    printf("    --apsides\n");
+    printf("        Writes the time and state at each periapsis and apoapsis \n        (of body 1 about body 0 for --free) to the standard \n        error, located within the step on a cubic through its \n        ends, or with --bulirsch-stoer on its substeps (unless \n        an output interval takes more than 64). Not available \n        with --parareal or --distributed.\n");
+    printf("    --distributed\n");
+    printf("        Splits the bodies of a --free --3D simulation across \n        worker processes (one per core, or $SIMULATOR_WORKERS). \n        The output is in the same form as a single process run. \n        Forces are added up in a different order, so the \n        numbers differ by rounding, which grows over long runs.\n");
+    printf("    --huge-pages\n");
+    printf("        Asks for the memory for the run to be backed by huge \n        pages where the system allows it.\n");
     printf("    --help\n");
     printf("        Displays this message.\n\n");
 
@@ -43,6 +60,215 @@ void help(){
     printf("    <body1var1>...<body1varN> <body1const1>...<body1constM>\n");
 }
 
+size_t integrator_size(int flags, int variable_count, int constant_count, sparse_matrix * pattern){
+    // memory the integrator chosen by flags will take from the arena. pattern is
+    // the Jacobian's, for --implicit.
+    if(flags & FLAG_IMPLICIT){
+        return rosenbrock_2nd_size(variable_count, constant_count, pattern);
+    }else if(flags & FLAG_BULIRSCH_STOER){
+        return bulirsch_stoer_size(variable_count, constant_count);
+    }
+    return runge_kutta_4th_size(variable_count, constant_count);
+}
+
+double environment_number(char * name, double fallback){
+    // the number in the environment variable name, or fallback if it isn't set
+    // to one
+    char * text = getenv(name);
+    char * end;
+    if(text == NULL){
+        return fallback;
+    }
+    double value = strtod(text, &end);
+    return end == text ? fallback : value;
+}
+
+int parareal_chunks(){
+    // one chunk per core, unless $SIMULATOR_PARAREAL_CHUNKS says otherwise
+    return (int)environment_number("SIMULATOR_PARAREAL_CHUNKS", sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+int distributed_workers(){
+    // one worker per core, unless $SIMULATOR_WORKERS says otherwise
+    return (int)environment_number("SIMULATOR_WORKERS", sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+size_t loop_size(int flags, int variable_count, int step_variable_count, int step_constant_count){
+    // memory the loop chosen by flags will take from the arena: that of
+    // iterate_to_file(), parareal_to_file() (with its workers' pools) or the
+    // --distributed processes.
+    if(flags & FLAG_PARAREAL){
+        int chunk_count = parareal_chunks();
+        return parareal_to_file_size(variable_count, step_variable_count, step_constant_count, chunk_count > 1 ? chunk_count : 1);
+    }else if(flags & FLAG_DISTRIBUTED){
+        return run_distributed_free_3d_orbit_size(distributed_workers());
+    }
+    return iterate_to_file_size(variable_count);
+}
+
+int run_parareal(int(*iter_func)(double *, double *, double), int variable_count, int step_variable_count, int step_constant_count, double * starting_values, double end_time, double step, char ** labels, FILE * fout){
+    // parareal_to_file() with parareal_chunks(), PARAREAL_COARSE_RATIO and
+    // PARAREAL_TOLERANCE, unless $SIMULATOR_PARAREAL_COARSE_RATIO or
+    // $SIMULATOR_PARAREAL_TOLERANCE say otherwise. The iterations taken are
+    // reported on the standard error.
+    int chunk_count = parareal_chunks();
+    double coarse_ratio = environment_number("SIMULATOR_PARAREAL_COARSE_RATIO", PARAREAL_COARSE_RATIO);
+    double tolerance = environment_number("SIMULATOR_PARAREAL_TOLERANCE", PARAREAL_TOLERANCE);
+    if(chunk_count < 1 || coarse_ratio < 1 || tolerance < 0){
+        printf("$SIMULATOR_PARAREAL_CHUNKS and $SIMULATOR_PARAREAL_COARSE_RATIO must be at least 1, and $SIMULATOR_PARAREAL_TOLERANCE at least 0.\n");
+        return 1;
+    }
+    int iterations = parareal_to_file(iter_func, variable_count, step_variable_count, step_constant_count, starting_values,
+        end_time, step, step * coarse_ratio, chunk_count, tolerance, labels, fout);
+    fprintf(stderr, "Parareal iterations taken: %d\n", iterations);
+    return 0;
+}
+
+void set_up_run_arena(int flags, size_t size, FILE * fout){
+    /*
+    Makes one arena for the run, big enough for size bytes as well as the
+    output buffer, so that nothing else needs to be allocated once the run has
+    started. If it can't be had, everything comes from the heap as before.
+    */
+    run_arena = create_arena(size + OUTPUT_BUFFER_SIZE + ARENA_SLACK, flags & FLAG_HUGE_PAGES);
+    use_arena(run_arena);
+    char * buffer = arena_alloc(run_arena, OUTPUT_BUFFER_SIZE);
+    if(buffer != NULL){
+        setvbuf(fout, buffer, _IOFBF, OUTPUT_BUFFER_SIZE);
+    }
+}
+
+char ** orbit_labels(int bodies, int dimensions){
+    // "time", then positions, velocities and mass for each body, then "time_limit"
+    char * axes[] = {"x", "y", "z"};
+    int stride = 2 * dimensions + 1;
+    int count = bodies * stride + 2;
+    char ** labels = arena_malloc(sizeof(char *) * count);
+    char * text = arena_malloc(LABEL_LENGTH * count);
+    int i, c;
+    labels[0] = "time";
+    for(i=0;i<bodies;i++){
+        for(c=0;c<dimensions;c++){
+            labels[i * stride + 1 + c] = &(text[(i * stride + 1 + c) * LABEL_LENGTH]);
+            snprintf(labels[i * stride + 1 + c], LABEL_LENGTH, "%d.%spos", i, axes[c]);
+            labels[i * stride + 1 + dimensions + c] = &(text[(i * stride + 1 + dimensions + c) * LABEL_LENGTH]);
+            snprintf(labels[i * stride + 1 + dimensions + c], LABEL_LENGTH, "%d.%svel", i, axes[c]);
+        }
+        labels[i * stride + stride] = &(text[(i * stride + stride) * LABEL_LENGTH]);
+        snprintf(labels[i * stride + stride], LABEL_LENGTH, "%d.mass", i);
+    }
+    labels[count - 1] = "time_limit";
+    return labels;
+}
+
+void set_up_apsides(double(*radial_velocity)(double *), double(*system)(double *, int), int system_variable_count){
+    event apsides[] = {{"periapsis", radial_velocity, EVENT_RISING, EVENT_LOG},
+        {"apoapsis", radial_velocity, EVENT_FALLING, EVENT_LOG}};
+    set_up_events(apsides, 2, system, system_variable_count, stderr, NULL);
+}
+
+void run_grid_network(double * numeric_args, int dimensions, int flags, FILE * fout){
+    // lays the nodes out on a grid (in the xy plane for 3D) and joins each one to
+    // the nodes to its right and below it. If the rest length differs from the
+    // spacing, the mesh starts out stretched or compressed.
+    int columns = (int)numeric_args[1], rows = (int)numeric_args[2];
+    double spacing = numeric_args[3];
+    int node_count = columns * rows, stride = 2 * dimensions;
+    int spring_count = (columns - 1) * rows + columns * (rows - 1);
+    int var_count = node_count * stride + 1;
+    int i, r, c, s = 0;
+
+    double * grid = calloc(node_count * stride, sizeof(double));
+    int * spring_ends = malloc(sizeof(int) * 2 * spring_count);
+    double * stiffness = malloc(sizeof(double) * spring_count);
+    double * rest_length = malloc(sizeof(double) * spring_count);
+    for(r=0;r<rows;r++){
+        for(c=0;c<columns;c++){
+            i = r * columns + c;
+            grid[i * stride] = c * spacing;
+            grid[i * stride + 1] = -r * spacing;
+            if(c + 1 < columns){
+                spring_ends[2 * s] = i;
+                spring_ends[2 * s + 1] = i + 1;
+                s ++;
+            }
+            if(r + 1 < rows){
+                spring_ends[2 * s] = i;
+                spring_ends[2 * s + 1] = i + columns;
+                s ++;
+            }
+        }
+    }
+    for(s=0;s<spring_count;s++){
+        stiffness[s] = numeric_args[6];
+        rest_length[s] = numeric_args[4];
+    }
+
+    size_t integrator = runge_kutta_4th_size(var_count, 1);
+    if(flags & FLAG_IMPLICIT){
+        // the fill in of the LU factors depends on the order build_spring_network()
+        // puts the nodes in, so build it once on the heap, from a copy of the grid,
+        // to size the arena
+        double * copy = malloc(sizeof(double) * node_count * stride);
+        memcpy(copy, grid, sizeof(double) * node_count * stride);
+        spring_network * trial = build_spring_network(node_count, dimensions, copy, spring_count, spring_ends,
+            stiffness, rest_length, numeric_args[5], numeric_args[7]);
+        sparse_matrix * pattern = spring_network_jacobian_pattern(trial);
+        integrator = rosenbrock_2nd_system_size(var_count, 1, pattern) + spring_network_jacobian_pattern_size(trial);
+        free_sparse_matrix(pattern);
+        free_spring_network(trial);
+        free(copy);
+    }
+
+    set_up_run_arena(flags, arena_size(sizeof(double) * (var_count + 1)) + spring_network_size(node_count, spring_count)
+        + arena_size(sizeof(char *) * (var_count + 1)) + arena_size(LABEL_LENGTH * (var_count + 1))
+        + integrator + iterate_to_file_size(var_count + 1), fout);
+    double * values = arena_malloc(sizeof(double) * (var_count + 1));
+    memcpy(&(values[1]), grid, sizeof(double) * node_count * stride);
+    free(grid);
+
+    network = build_spring_network(node_count, dimensions, &(values[1]), spring_count, spring_ends,
+        stiffness, rest_length, numeric_args[5], numeric_args[7]);
+    free(spring_ends);
+    free(stiffness);
+    free(rest_length);
+    values[0] = numeric_args[0];
+    values[var_count] = numeric_args[8];
+
+    // label the columns by the index each node was given above, rather than
+    // its position in the (reordered) state
+    char * axes[] = {"x", "y", "z"};
+    char ** labels = arena_malloc(sizeof(char *) * (var_count + 1));
+    char * text = arena_malloc(LABEL_LENGTH * (var_count + 1));
+    labels[0] = "time";
+    for(i=0;i<node_count;i++){
+        for(c=0;c<dimensions;c++){
+            labels[1 + i * stride + c] = &(text[(1 + i * stride + c) * LABEL_LENGTH]);
+            snprintf(labels[1 + i * stride + c], LABEL_LENGTH, "%d.%spos", network->original_index[i], axes[c]);
+            labels[1 + i * stride + dimensions + c] = &(text[(1 + i * stride + dimensions + c) * LABEL_LENGTH]);
+            snprintf(labels[1 + i * stride + dimensions + c], LABEL_LENGTH, "%d.%svel", network->original_index[i], axes[c]);
+        }
+    }
+    labels[var_count] = "time_limit";
+
+    if(flags & FLAG_IMPLICIT){
+        // the springs don't depend on the time, so the system is autonomous
+        sparse_matrix * pattern = spring_network_jacobian_pattern(network);
+        set_up_rosenbrock_2nd_system(var_count, 1, pattern, NULL, 1);
+        free_sparse_matrix(pattern);
+        iterate_to_file(&spring_network_rosenbrock_2nd, var_count + 1, values, numeric_args[9], labels, fout);
+        free_rosenbrock_2nd();
+    }else{
+        set_up_runge_kutta_4th(var_count, 1);
+        iterate_to_file(&spring_network_runge_kutta_4th, var_count + 1, values, numeric_args[9], labels, fout);
+        free_runge_kutta_4th();
+    }
+    free_spring_network(network);
+    arena_free(labels);
+    arena_free(text);
+    arena_free(values);
+}
+
 int main(int argc, char ** args){
     char *flag_array[] = FLAG_ARRAY;
     int flags = process_flags(argc, args, FLAG_ARRAY_SIZE, flag_array);
@@ -59,6 +285,27 @@ int main(int argc, char ** args){
         return 1;
     }
 
+    if(!!(flags & FLAG_PARAREAL) + !!(flags & FLAG_IMPLICIT) + !!(flags & FLAG_BULIRSCH_STOER) + !!(flags & FLAG_DISTRIBUTED) > 1){
+        printf("Only one of --implicit, --parareal, --bulirsch-stoer and --distributed may be given.\n");
+        return 1;
+    }
+
+    if((flags & FLAG_APSIDES) && (flags & (FLAG_PARAREAL | FLAG_DISTRIBUTED))){
+        // neither checks for events
+        printf("--apsides can not be used with --parareal or --distributed.\n");
+        return 1;
+    }
+
+    if((flags & FLAG_DISTRIBUTED) && !((flags & FLAG_ORBIT) && (flags & FLAG_FREE) && (flags & FLAG_3D))){
+        printf("--distributed is only available for --orbit --free --3D.\n");
+        return 1;
+    }
+
+    if((flags & FLAG_NETWORK) && (flags & (FLAG_PARAREAL | FLAG_BULIRSCH_STOER | FLAG_DISTRIBUTED | FLAG_APSIDES))){
+        printf("--network can only be used with --implicit, not --parareal, --bulirsch-stoer, --distributed or --apsides.\n");
+        return 1;
+    }
+
     // first argument should always be a file unless --stdout
     FILE * fout;
     if(flags & FLAG_STDOUT){
@@ -72,14 +319,54 @@ int main(int argc, char ** args){
         }
     }
 
+    if(flags & FLAG_NETWORK){
+        if(!(flags & FLAG_2D) && !(flags & FLAG_3D)){
+            printf("Please specify either --2D or --3D\n");
+            help();
+            return 1;
+        }
+        if(numeric_arg_count != 10 || numeric_args[1] < 1 || numeric_args[2] < 1){
+            printf("Invalid number of numerical arguments. Need 10 with at least 1 row and column, %d given.\n", numeric_arg_count);
+            help();
+            return 1;
+        }
+        run_grid_network(numeric_args, (flags & FLAG_3D) ? 3 : 2, flags, fout);
+    }
+
     if(flags & FLAG_ORBIT){
         if(flags & FLAG_SIMPLE){
             if(flags & FLAG_2D){
                 if(numeric_arg_count == 8){
                     char *labels[8] = {"time", "xpos", "ypos", "xvel", "yvel", "object_mass", "time_limit", "total_energy"};
-                    set_up_runge_kutta_4th(5, 2);
-                    iterate_to_file(&simple_2d_orbit_runge_kutta_4th, 8, numeric_args, numeric_args[7], labels, fout);
-                    free_runge_kutta_4th();
+                    // the Jacobian's pattern comes from the heap, as the arena is sized from it
+                    sparse_matrix * pattern = (flags & FLAG_IMPLICIT) ? orbit_jacobian_pattern(1, 2, 4) : NULL;
+                    set_up_run_arena(flags, integrator_size(flags, 5, 2, pattern) + loop_size(flags, 8, 5, 2), fout);
+                    if(flags & FLAG_APSIDES){
+                        set_up_apsides(&simple_2d_orbit_radial_velocity, &simple_2d_orbit_functions, 5);
+                    }
+                    if(flags & FLAG_IMPLICIT){
+                        // the orbits are autonomous: gravity does not depend on the time
+                        set_up_rosenbrock_2nd(5, 2, pattern, NULL, 1);
+                        free_sparse_matrix(pattern);
+                        iterate_to_file(&simple_2d_orbit_rosenbrock_2nd, 8, numeric_args, numeric_args[7], labels, fout);
+                        free_rosenbrock_2nd();
+                    }else if(flags & FLAG_BULIRSCH_STOER){
+                        set_up_bulirsch_stoer(5, 2, BULIRSCH_STOER_TOLERANCE);
+                        // locate any events on the substeps rather than across the output interval
+                        set_event_dense_output(&bulirsch_stoer_dense_output);
+                        iterate_to_file(&simple_2d_orbit_bulirsch_stoer, 8, numeric_args, numeric_args[7], labels, fout);
+                        free_bulirsch_stoer();
+                    }else if(flags & FLAG_PARAREAL){
+                        set_up_runge_kutta_4th(5, 2);
+                        if(run_parareal(&simple_2d_orbit_runge_kutta_4th, 8, 5, 2, numeric_args, numeric_args[6], numeric_args[7], labels, fout) != 0){
+                            return 1;
+                        }
+                        free_runge_kutta_4th();
+                    }else{
+                        set_up_runge_kutta_4th(5, 2);
+                        iterate_to_file(&simple_2d_orbit_runge_kutta_4th, 8, numeric_args, numeric_args[7], labels, fout);
+                        free_runge_kutta_4th();
+                    }
                 }else{
                     printf("Invalid number of numerical arguments. Need 8, %d given.\n", numeric_arg_count);
                 }
@@ -91,25 +378,36 @@ int main(int argc, char ** args){
                 // make sure a valid number of args has been entered
                 if(numeric_arg_count >= 8 && (numeric_arg_count - 3) % 5 == 0){
                     body_count = (numeric_arg_count - 3) / 5;
-                    char ** labels = malloc(sizeof(char *) * (body_count * 5 + 2));
-                    labels[0] = "time";
-                    int i;
-                    for(i=0;i<body_count;i++){
-                        labels[i * 5 + 1] = malloc(8);
-                        sprintf(labels[i * 5 + 1], "%d.xpos", i);
-                        labels[i * 5 + 2] = malloc(8);
-                        sprintf(labels[i * 5 + 2], "%d.ypos", i);
-                        labels[i * 5 + 3] = malloc(8);
-                        sprintf(labels[i * 5 + 3], "%d.xvel", i);
-                        labels[i * 5 + 4] = malloc(8);
-                        sprintf(labels[i * 5 + 4], "%d.yvel", i);
-                        labels[i * 5 + 5] = malloc(8);
-                        sprintf(labels[i * 5 + 5], "%d.mass", i);
+                    sparse_matrix * pattern = (flags & FLAG_IMPLICIT) ? orbit_jacobian_pattern(body_count, 2, 5) : NULL;
+                    set_up_run_arena(flags, integrator_size(flags, 5 * body_count + 1, 1, pattern)
+                        + loop_size(flags, 5 * body_count + 2, 5 * body_count + 1, 1) + arena_size(sizeof(char *) * (5 * body_count + 2))
+                        + arena_size(LABEL_LENGTH * (5 * body_count + 2)), fout);
+                    char ** labels = orbit_labels(body_count, 2);
+                    if((flags & FLAG_APSIDES) && body_count >= 2){
+                        set_up_apsides(&free_2d_orbit_radial_velocity, &free_2d_orbit_functions, 5 * body_count + 1);
+                    }
+                    if(flags & FLAG_IMPLICIT){
+                        set_up_rosenbrock_2nd(5 * body_count + 1, 1, pattern, NULL, 1);
+                        free_sparse_matrix(pattern);
+                        iterate_to_file(&free_2d_orbit_rosenbrock_2nd, 5 * body_count + 2, numeric_args, numeric_args[numeric_arg_count - 1], labels, fout);
+                        free_rosenbrock_2nd();
+                    }else if(flags & FLAG_BULIRSCH_STOER){
+                        set_up_bulirsch_stoer(5 * body_count + 1, 1, BULIRSCH_STOER_TOLERANCE);
+                        set_event_dense_output(&bulirsch_stoer_dense_output);
+                        iterate_to_file(&free_2d_orbit_bulirsch_stoer, 5 * body_count + 2, numeric_args, numeric_args[numeric_arg_count - 1], labels, fout);
+                        free_bulirsch_stoer();
+                    }else if(flags & FLAG_PARAREAL){
+                        set_up_runge_kutta_4th(5 * body_count + 1, 1);
+                        if(run_parareal(&free_2d_orbit_runge_kutta_4th, 5 * body_count + 2, 5 * body_count + 1, 1, numeric_args,
+                            numeric_args[numeric_arg_count - 2], numeric_args[numeric_arg_count - 1], labels, fout) != 0){
+                            return 1;
+                        }
+                        free_runge_kutta_4th();
+                    }else{
+                        set_up_runge_kutta_4th(5 * body_count + 1, 1);
+                        iterate_to_file(&free_2d_orbit_runge_kutta_4th, 5 * body_count + 2, numeric_args, numeric_args[numeric_arg_count - 1], labels, fout);
+                        free_runge_kutta_4th();
                     }
-                    labels[body_count * 5 + 1] = "time_limit";
-                    set_up_runge_kutta_4th(5 * body_count + 1, 1);
-                    iterate_to_file(&free_2d_orbit_runge_kutta_4th, 5 * body_count + 2, numeric_args, numeric_args[numeric_arg_count - 1], labels, fout);
-                    free_runge_kutta_4th();
                 }else{
                     printf("Invalid number of numerical arguments. Need at least 8 with 5 arguments for each body. %d given\n", numeric_arg_count);
                     help();
@@ -119,29 +417,41 @@ int main(int argc, char ** args){
                 // make sure a valid number of args have been entered
                 if(numeric_arg_count >= 10 && (numeric_arg_count - 3) % 7 == 0){
                     body_count = (numeric_arg_count - 3) / 7;
-                    char ** labels = malloc(sizeof(char *) * (body_count * 7 + 2));
-                    labels[0] = "time";
-                    int i;
-                    for(i=0;i<body_count;i++){
-                        labels[i * 7 + 1] = malloc(8);
-                        sprintf(labels[i * 7 + 1], "%d.xpos", i);
-                        labels[i * 7 + 2] = malloc(8);
-                        sprintf(labels[i * 7 + 2], "%d.ypos", i);
-                        labels[i * 7 + 3] = malloc(8);
-                        sprintf(labels[i * 7 + 3], "%d.zpos", i);
-                        labels[i * 7 + 4] = malloc(8);
-                        sprintf(labels[i * 7 + 4], "%d.xvel", i);
-                        labels[i * 7 + 5] = malloc(8);
-                        sprintf(labels[i * 7 + 5], "%d.yvel", i);
-                        labels[i * 7 + 6] = malloc(8);
-                        sprintf(labels[i * 7 + 6], "%d.zvel", i);
-                        labels[i * 7 + 7] = malloc(8);
-                        sprintf(labels[i * 7 + 7], "%d.mass", i);
+                    sparse_matrix * pattern = (flags & FLAG_IMPLICIT) ? orbit_jacobian_pattern(body_count, 3, 7) : NULL;
+                    set_up_run_arena(flags, integrator_size(flags, 7 * body_count + 1, 1, pattern)
+                        + loop_size(flags, 7 * body_count + 2, 7 * body_count + 1, 1) + arena_size(sizeof(char *) * (7 * body_count + 2))
+                        + arena_size(LABEL_LENGTH * (7 * body_count + 2)), fout);
+                    char ** labels = orbit_labels(body_count, 3);
+                    if((flags & FLAG_APSIDES) && body_count >= 2){
+                        set_up_apsides(&free_3d_orbit_radial_velocity, &free_3d_orbit_functions, 7 * body_count + 1);
+                    }
+                    if(flags & FLAG_IMPLICIT){
+                        set_up_rosenbrock_2nd(7 * body_count + 1, 1, pattern, NULL, 1);
+                        free_sparse_matrix(pattern);
+                        iterate_to_file(&free_3d_orbit_rosenbrock_2nd, 7 * body_count + 2, numeric_args, numeric_args[numeric_arg_count - 1], labels, fout);
+                        free_rosenbrock_2nd();
+                    }else if(flags & FLAG_DISTRIBUTED){
+                        if(run_distributed_free_3d_orbit(distributed_workers(),
+                            numeric_args, numeric_args[numeric_arg_count - 1], labels, fout) != 0){
+                            return 1;
+                        }
+                    }else if(flags & FLAG_BULIRSCH_STOER){
+                        set_up_bulirsch_stoer(7 * body_count + 1, 1, BULIRSCH_STOER_TOLERANCE);
+                        set_event_dense_output(&bulirsch_stoer_dense_output);
+                        iterate_to_file(&free_3d_orbit_bulirsch_stoer, 7 * body_count + 2, numeric_args, numeric_args[numeric_arg_count - 1], labels, fout);
+                        free_bulirsch_stoer();
+                    }else if(flags & FLAG_PARAREAL){
+                        set_up_runge_kutta_4th(7 * body_count + 1, 1);
+                        if(run_parareal(&free_3d_orbit_runge_kutta_4th, 7 * body_count + 2, 7 * body_count + 1, 1, numeric_args,
+                            numeric_args[numeric_arg_count - 2], numeric_args[numeric_arg_count - 1], labels, fout) != 0){
+                            return 1;
+                        }
+                        free_runge_kutta_4th();
+                    }else{
+                        set_up_runge_kutta_4th(7 * body_count + 1, 1);
+                        iterate_to_file(&free_3d_orbit_runge_kutta_4th, 7 * body_count + 2, numeric_args, numeric_args[numeric_arg_count - 1], labels, fout);
+                        free_runge_kutta_4th();
                     }
-                    labels[body_count * 7 + 1] = "time_limit";
-                    set_up_runge_kutta_4th(7 * body_count + 1, 1);
-                    iterate_to_file(&free_3d_orbit_runge_kutta_4th, 7 * body_count + 2, numeric_args, numeric_args[numeric_arg_count - 1], labels, fout);
-                    free_runge_kutta_4th();
                 }else{
                     printf("Invalid number of numerical arguments. Need at least 10 with 7 arguments for each body. %d given\n", numeric_arg_count);
                     help();
@@ -159,5 +469,9 @@ int main(int argc, char ** args){
         }
     }
 
+    free_events();
+    fclose(fout);
+    free_arena(run_arena);
+    free(numeric_args);
     return 0;
 }
@@ -6,12 +6,14 @@
 
 #import "lib.h"
 #include "rk_functions.h"
+#include "distributed.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 
-#define FLAG_ARRAY {"--orbit", "--simple", "--free", "--2D", "--3D", "--help", "--stdout", "--resume"}
-#define FLAG_ARRAY_SIZE 7
+#define FLAG_ARRAY {"--orbit", "--simple", "--free", "--2D", "--3D", "--help", "--stdout", "--resume", "--implicit", "--network", "--parareal", "--bulirsch-stoer", "--apsides", "--distributed", "--huge-pages"}
+#define FLAG_ARRAY_SIZE 15
 
 #define FLAG_ORBIT 1
 #define FLAG_SIMPLE 2
@@ -21,8 +23,29 @@
 #define FLAG_HELP 32
 #define FLAG_STDOUT 64
 #define FLAG_RESUME 128
+#define FLAG_IMPLICIT 256
+#define FLAG_NETWORK 512
+#define FLAG_PARAREAL 1024
+#define FLAG_BULIRSCH_STOER 2048
+#define FLAG_APSIDES 4096
+#define FLAG_DISTRIBUTED 8192
+#define FLAG_HUGE_PAGES 16384
+
+// room for each column label, ie, "123456.xvel"
+#define LABEL_LENGTH 32
 
 int body_count;
+spring_network * network;
 
 int main(int argc, char ** args);
 void help();
+size_t integrator_size(int flags, int variable_count, int constant_count, sparse_matrix * pattern);
+double environment_number(char * name, double fallback);
+int parareal_chunks();
+int distributed_workers();
+size_t loop_size(int flags, int variable_count, int step_variable_count, int step_constant_count);
+int run_parareal(int(*iter_func)(double *, double *, double), int variable_count, int step_variable_count, int step_constant_count, double * starting_values, double end_time, double step, char ** labels, FILE * fout);
+void set_up_run_arena(int flags, size_t size, FILE * fout);
+char ** orbit_labels(int bodies, int dimensions);
+void set_up_apsides(double(*radial_velocity)(double *), double(*system)(double *, int), int system_variable_count);
+void run_grid_network(double * numeric_args, int dimensions, int flags, FILE * fout);
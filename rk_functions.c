@@ -6,6 +6,25 @@
 
 #include "rk_functions.h"
 
+static double step_to_limit(double * vars_in, double step, double time_limit){
+    // shortens the last step so that the run ends exactly on the time limit
+    // rather than overshooting it.
+    if(vars_in[0] + step > time_limit){
+        return time_limit - vars_in[0];
+    }
+    return step;
+}
+
+static int check_time_limit(double * vars_out, double step, double time_limit){
+    // time + the shortened step can be out in the last place, so snap to the limit.
+    if(vars_out[0] >= time_limit - fabs(step) * 1E-9){
+        vars_out[0] = time_limit;
+        return STOP_ITERATING;
+    }else{
+        return CONTINUE_ITERATING;
+    }
+}
+
 double simple_2d_orbit_functions(double * vars_in, int function_ref){
     /*
     Our variables are as follows:
@@ -52,19 +71,28 @@ double simple_2d_orbit_functions(double * vars_in, int function_ref){
     }
 }
 
-int simple_2d_orbit_runge_kutta_4th(double * vars_in, double * vars_out, double step){
-    runge_kutta_4th(&simple_2d_orbit_functions, vars_in, vars_out, 5, 2, step);
+static int simple_2d_orbit_step(step_method method, double * vars_in, double * vars_out, double step){
+    step = step_to_limit(vars_in, step, vars_in[6]);
+    method(&simple_2d_orbit_functions, vars_in, vars_out, 5, 2, step);
 
     // we also want to know the total energy per unit mass of the satellite. So whack that into a variable.
     vars_out[7] = .5 * (pow(vars_out[3], 2) + pow(vars_out[4], 2)) - 
         GRAVITATIONAL_CONSTANT * vars_out[5] / sqrt(pow(vars_out[1],2) + pow(vars_out[2],2));
 
     // check the terminating condition. In this case, a time limit.
-    if(vars_out[0] >= vars_in[6]){
-        return STOP_ITERATING;
-    }else{
-        return CONTINUE_ITERATING;
-    }
+    return check_time_limit(vars_out, step, vars_in[6]);
+}
+
+int simple_2d_orbit_runge_kutta_4th(double * vars_in, double * vars_out, double step){
+    return simple_2d_orbit_step(&runge_kutta_4th, vars_in, vars_out, step);
+}
+
+int simple_2d_orbit_rosenbrock_2nd(double * vars_in, double * vars_out, double step){
+    return simple_2d_orbit_step(&rosenbrock_2nd, vars_in, vars_out, step);
+}
+
+int simple_2d_orbit_bulirsch_stoer(double * vars_in, double * vars_out, double step){
+    return simple_2d_orbit_step(&bulirsch_stoer, vars_in, vars_out, step);
 }
 
 double free_2d_orbit_functions(double * vars_in, int function_ref){
@@ -160,17 +188,26 @@ double free_2d_orbit_functions(double * vars_in, int function_ref){
     }
 }
 
-int free_2d_orbit_runge_kutta_4th(double * vars_in, double * vars_out, double step){
+static int free_2d_orbit_step(step_method method, double * vars_in, double * vars_out, double step){
     // this is a 2D simulation, so the number of variables is 5 * body_count + 1
     // (4 variables: xpos, ypos, xvel, yvel and 1 constant: mass of body)
-    runge_kutta_4th(&free_2d_orbit_functions, vars_in, vars_out, 5 * body_count + 1, 1, step);
+    step = step_to_limit(vars_in, step, vars_in[5 * body_count + 1]);
+    method(&free_2d_orbit_functions, vars_in, vars_out, 5 * body_count + 1, 1, step);
 
     // check the terminating condition. In this case, a time limit.
-    if(vars_out[0] >= vars_in[5 * body_count + 1]){
-        return STOP_ITERATING;
-    }else{
-        return CONTINUE_ITERATING;
-    }
+    return check_time_limit(vars_out, step, vars_in[5 * body_count + 1]);
+}
+
+int free_2d_orbit_runge_kutta_4th(double * vars_in, double * vars_out, double step){
+    return free_2d_orbit_step(&runge_kutta_4th, vars_in, vars_out, step);
+}
+
+int free_2d_orbit_rosenbrock_2nd(double * vars_in, double * vars_out, double step){
+    return free_2d_orbit_step(&rosenbrock_2nd, vars_in, vars_out, step);
+}
+
+int free_2d_orbit_bulirsch_stoer(double * vars_in, double * vars_out, double step){
+    return free_2d_orbit_step(&bulirsch_stoer, vars_in, vars_out, step);
 }
 
 double free_3d_orbit_functions(double * vars_in, int function_ref){
@@ -300,14 +337,312 @@ double free_3d_orbit_functions(double * vars_in, int function_ref){
     }
 }
 
-int free_3d_orbit_runge_kutta_4th(double * vars_in, double * vars_out, double step){
+static int free_3d_orbit_step(step_method method, double * vars_in, double * vars_out, double step){
     // this is a 3D simulation, so the number of variables is 7 * body_count + 1
     // (6 variables: xpos, ypos, zpos, xvel, yvel, zvel and 1 constant/body: mass of body)
-    runge_kutta_4th(&free_3d_orbit_functions, vars_in, vars_out, 7 * body_count + 1, 1, step);
+    step = step_to_limit(vars_in, step, vars_in[7 * body_count + 1]);
+    method(&free_3d_orbit_functions, vars_in, vars_out, 7 * body_count + 1, 1, step);
     // check the terminating condition. In this case, a time limit.
-    if(vars_out[0] >= vars_in[7 * body_count + 1]){
-        return STOP_ITERATING;
-    }else{
-        return CONTINUE_ITERATING;
+    return check_time_limit(vars_out, step, vars_in[7 * body_count + 1]);
+}
+
+int free_3d_orbit_runge_kutta_4th(double * vars_in, double * vars_out, double step){
+    return free_3d_orbit_step(&runge_kutta_4th, vars_in, vars_out, step);
+}
+
+int free_3d_orbit_rosenbrock_2nd(double * vars_in, double * vars_out, double step){
+    return free_3d_orbit_step(&rosenbrock_2nd, vars_in, vars_out, step);
+}
+
+int free_3d_orbit_bulirsch_stoer(double * vars_in, double * vars_out, double step){
+    return free_3d_orbit_step(&bulirsch_stoer, vars_in, vars_out, step);
+}
+
+double simple_2d_orbit_radial_velocity(double * vars_in){
+    // r.v for the satellite, which rises through zero at periapsis and falls
+    // through zero at apoapsis. For use as an event function.
+    return vars_in[1] * vars_in[3] + vars_in[2] * vars_in[4];
+}
+
+double free_2d_orbit_radial_velocity(double * vars_in){
+    // as above, for body 1 relative to body 0
+    return (vars_in[6] - vars_in[1]) * (vars_in[8] - vars_in[3]) + (vars_in[7] - vars_in[2]) * (vars_in[9] - vars_in[4]);
+}
+
+double free_3d_orbit_radial_velocity(double * vars_in){
+    // as above, for body 1 relative to body 0
+    return (vars_in[8] - vars_in[1]) * (vars_in[11] - vars_in[4]) + (vars_in[9] - vars_in[2]) * (vars_in[12] - vars_in[5])
+        + (vars_in[10] - vars_in[3]) * (vars_in[13] - vars_in[6]);
+}
+
+sparse_matrix * orbit_jacobian_pattern(int bodies, int dimensions, int stride){
+    /*
+    Sparsity pattern of the Jacobian for the orbit functions, for use with
+    set_up_rosenbrock_2nd(). Each body takes up stride variables, laid out as
+    positions, then velocities, then anything else (ie, mass). Position rows
+    depend only on the matching velocity and velocity rows depend on the
+    positions of every body. Rows for anything else are empty.
+    */
+    sparse_matrix * pattern = alloc_sparse_matrix(bodies * stride,
+        bodies * dimensions * (1 + bodies * dimensions));
+    int b, c, other, other_c, row, n = 0;
+    for(b=0;b<bodies;b++){
+        for(c=0;c<stride;c++){
+            row = b * stride + c;
+            pattern->row_start[row] = n;
+            if(c < dimensions){
+                pattern->col_index[n++] = b * stride + dimensions + c;
+            }else if(c < 2 * dimensions){
+                for(other=0;other<bodies;other++){
+                    for(other_c=0;other_c<dimensions;other_c++){
+                        pattern->col_index[n++] = other * stride + other_c;
+                    }
+                }
+            }
+        }
+    }
+    pattern->row_start[bodies * stride] = n;
+    return pattern;
+}
+
+typedef struct {
+    unsigned long long key;
+    int index;
+} curve_entry;
+
+static int compare_curve_entries(const void * a, const void * b){
+    unsigned long long ka = ((curve_entry *)a)->key, kb = ((curve_entry *)b)->key;
+    return (ka > kb) - (ka < kb);
+}
+
+static unsigned long long morton_key(double * position, double * low, double * high, int dimensions){
+    // interleaves the bits of each coordinate (scaled to the bounding box) so
+    // that nodes which are close in space end up close together in the order.
+    int bits = 63 / dimensions, b, c;
+    unsigned long long key = 0, scale = (1ULL << bits) - 1;
+    unsigned long long cell[3];
+    for(c=0;c<dimensions;c++){
+        double span = high[c] - low[c];
+        cell[c] = span > 0 ? (unsigned long long)((position[c] - low[c]) / span * scale) : 0;
+    }
+    for(b=bits-1;b>=0;b--){
+        for(c=0;c<dimensions;c++){
+            key = (key << 1) | ((cell[c] >> b) & 1);
+        }
+    }
+    return key;
+}
+
+size_t spring_network_size(int node_count, int spring_count){
+    // what build_spring_network() keeps, for sizing an arena
+    return arena_size(sizeof(spring_network)) + sparse_matrix_size(node_count, 2 * spring_count)
+        + arena_size(sizeof(double) * 2 * spring_count) + arena_size(sizeof(int) * node_count);
+}
+
+spring_network * build_spring_network(int node_count, int dimensions, double * state, int spring_count, int * spring_ends, double * stiffness, double * rest_length, double node_mass, double damping){
+    /*
+    state holds 2 * dimensions values for each node (positions, then
+    velocities) and is reordered in place along a Morton curve. spring_ends
+    holds the two node indices of each spring, in the original numbering.
+    */
+    int stride = 2 * dimensions;
+    int i, c, n;
+    spring_network * net = arena_malloc(sizeof(spring_network));
+    net->node_count = node_count;
+    net->dimensions = dimensions;
+    net->node_mass = node_mass;
+    net->damping = damping;
+
+    // sort the nodes along the curve
+    double low[3], high[3];
+    for(c=0;c<dimensions;c++){
+        low[c] = high[c] = node_count > 0 ? state[c] : 0;
+    }
+    for(i=0;i<node_count;i++){
+        for(c=0;c<dimensions;c++){
+            low[c] = fmin(low[c], state[i * stride + c]);
+            high[c] = fmax(high[c], state[i * stride + c]);
+        }
+    }
+    curve_entry * order = malloc(sizeof(curve_entry) * node_count);
+    for(i=0;i<node_count;i++){
+        order[i].key = morton_key(&(state[i * stride]), low, high, dimensions);
+        order[i].index = i;
+    }
+    qsort(order, node_count, sizeof(curve_entry), &compare_curve_entries);
+
+    // new_index[original] --> position in the curve order
+    int * new_index = malloc(sizeof(int) * node_count);
+    double * sorted_state = malloc(sizeof(double) * node_count * stride);
+    net->original_index = arena_malloc(sizeof(int) * node_count);
+    for(i=0;i<node_count;i++){
+        net->original_index[i] = order[i].index;
+        new_index[order[i].index] = i;
+        memcpy(&(sorted_state[i * stride]), &(state[order[i].index * stride]), sizeof(double) * stride);
+    }
+    memcpy(state, sorted_state, sizeof(double) * node_count * stride);
+    free(sorted_state);
+    free(order);
+
+    // build the symmetric CSR adjacency. Count each node's springs first,
+    // then fill in the rows.
+    net->springs = alloc_sparse_matrix(node_count, 2 * spring_count);
+    net->rest_length = arena_malloc(sizeof(double) * 2 * spring_count);
+    int * fill = calloc(node_count + 1, sizeof(int));
+    for(i=0;i<spring_count;i++){
+        fill[new_index[spring_ends[2 * i]] + 1] ++;
+        fill[new_index[spring_ends[2 * i + 1]] + 1] ++;
+    }
+    for(i=0;i<node_count;i++){
+        fill[i + 1] += fill[i];
+    }
+    memcpy(net->springs->row_start, fill, sizeof(int) * (node_count + 1));
+    for(i=0;i<spring_count;i++){
+        int a = new_index[spring_ends[2 * i]], b = new_index[spring_ends[2 * i + 1]];
+        n = fill[a]++;
+        net->springs->col_index[n] = b;
+        net->springs->values[n] = stiffness[i];
+        net->rest_length[n] = rest_length[i];
+        n = fill[b]++;
+        net->springs->col_index[n] = a;
+        net->springs->values[n] = stiffness[i];
+        net->rest_length[n] = rest_length[i];
+    }
+    free(fill);
+    free(new_index);
+    return net;
+}
+
+void free_spring_network(spring_network * net){
+    if(net == NULL){
+        return;
+    }
+    free_sparse_matrix(net->springs);
+    arena_free(net->rest_length);
+    arena_free(net->original_index);
+    arena_free(net);
+}
+
+void spring_network_functions(double * vars_in, double * rates){
+    /*
+    Our variables and constants are as follows (for 2D, 3D adds a z component):
+    0 --> time
+    1 --> xpos of node 0
+    2 --> ypos of node 0
+    3 --> xvel of node 0
+    4 --> yvel of node 0
+    .
+    .
+    (node count * 4 + 1)
+      --> time limit
+
+    Each node's row of the adjacency is walked once and only that node's rates
+    are written, so the cost is one pass over the springs (twice the spring
+    count) with no scattered writes.
+    */
+    int d = network->dimensions, stride = 2 * d;
+    int i, c, n;
+    double * pos, * vel, * other_pos, * other_vel;
+    double diff[3], length, extension, closing_speed, force;
+    for(i=0;i<network->node_count;i++){
+        pos = &(vars_in[1 + i * stride]);
+        vel = pos + d;
+        double * rate = &(rates[i * stride]);
+        for(c=0;c<d;c++){
+            rate[c] = vel[c];
+            rate[d + c] = 0;
+        }
+        for(n=network->springs->row_start[i];n<network->springs->row_start[i + 1];n++){
+            other_pos = &(vars_in[1 + network->springs->col_index[n] * stride]);
+            other_vel = other_pos + d;
+            length = 0;
+            for(c=0;c<d;c++){
+                diff[c] = other_pos[c] - pos[c];
+                length += diff[c] * diff[c];
+            }
+            length = sqrt(length);
+            if(length <= DBL_EPSILON){
+                continue;
+            }
+            extension = length - network->rest_length[n];
+            closing_speed = 0;
+            for(c=0;c<d;c++){
+                closing_speed += (other_vel[c] - vel[c]) * diff[c];
+            }
+            closing_speed /= length;
+            force = (network->springs->values[n] * extension + network->damping * closing_speed) / length;
+            for(c=0;c<d;c++){
+                rate[d + c] += force * diff[c];
+            }
+        }
+        for(c=0;c<d;c++){
+            rate[d + c] /= network->node_mass;
+        }
+    }
+}
+
+static int spring_network_step(system_step_method method, double * vars_in, double * vars_out, double step){
+    int var_count = 2 * network->dimensions * network->node_count + 1;
+    step = step_to_limit(vars_in, step, vars_in[var_count]);
+    method(&spring_network_functions, vars_in, vars_out, var_count, 1, step);
+
+    // check the terminating condition. In this case, a time limit.
+    return check_time_limit(vars_out, step, vars_in[var_count]);
+}
+
+int spring_network_runge_kutta_4th(double * vars_in, double * vars_out, double step){
+    return spring_network_step(&runge_kutta_4th_system, vars_in, vars_out, step);
+}
+
+int spring_network_rosenbrock_2nd(double * vars_in, double * vars_out, double step){
+    return spring_network_step(&rosenbrock_2nd_system, vars_in, vars_out, step);
+}
+
+size_t spring_network_jacobian_pattern_size(spring_network * net){
+    int d = net->dimensions, stride = 2 * d;
+    return sparse_matrix_size(stride * net->node_count, d * (net->node_count * (1 + stride) + stride * net->springs->nonzero_count));
+}
+
+sparse_matrix * spring_network_jacobian_pattern(spring_network * net){
+    /*
+    The sparsity of the Jacobian of spring_network_functions(), for
+    set_up_rosenbrock_2nd_system(), read off the adjacency: a position's rate
+    is its own velocity, and a velocity's rate depends on every position and
+    velocity of its node and of the nodes joined to it. A node joined to
+    another by more than one spring (or to itself) gets each entry once.
+    Free it with free_sparse_matrix().
+    */
+    int d = net->dimensions, stride = 2 * d;
+    int rows = stride * net->node_count;
+    sparse_matrix * pattern = alloc_sparse_matrix(rows, d * (net->node_count * (1 + stride) + stride * net->springs->nonzero_count));
+    int * last_row = malloc(sizeof(int) * net->node_count);
+    int i, c, e, m, n, count = 0;
+    for(i=0;i<net->node_count;i++){
+        last_row[i] = -1;
+    }
+    for(i=0;i<net->node_count;i++){
+        for(c=0;c<d;c++){
+            pattern->row_start[i * stride + c] = count;
+            pattern->col_index[count++] = i * stride + d + c;
+        }
+        for(c=0;c<d;c++){
+            int row = i * stride + d + c;
+            pattern->row_start[row] = count;
+            for(n=net->springs->row_start[i]-1;n<net->springs->row_start[i + 1];n++){
+                // n below the row's start stands for the node itself
+                m = n < net->springs->row_start[i] ? i : net->springs->col_index[n];
+                if(last_row[m] == row){
+                    continue;
+                }
+                last_row[m] = row;
+                for(e=0;e<stride;e++){
+                    pattern->col_index[count++] = m * stride + e;
+                }
+            }
+        }
     }
+    pattern->row_start[rows] = count;
+    pattern->nonzero_count = count;
+    free(last_row);
+    return pattern;
 }
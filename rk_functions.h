@@ -11,11 +11,47 @@
 #define GRAVITATIONAL_CONSTANT 6.673E-11
 // #define VERBOSE_DEBUG
 
+/*
+A network of point masses joined by damped springs. The springs are held as a
+symmetric CSR adjacency matrix (each spring appears in the rows of both of its
+ends) with the stiffness in values and the natural length in rest_length.
+Nodes are stored in space-filling curve order; original_index maps a node's
+position in the state back to the index it was given in.
+*/
+typedef struct {
+    int node_count;
+    int dimensions;
+    double node_mass;
+    double damping;
+    sparse_matrix * springs;
+    double * rest_length;
+    int * original_index;
+} spring_network;
+
 extern int body_count;
+extern spring_network * network;
 
 double simple_2d_orbit_functions(double * vars_in, int function_ref);
 int simple_2d_orbit_runge_kutta_4th(double * vars_in, double * vars_out, double step);
+int simple_2d_orbit_rosenbrock_2nd(double * vars_in, double * vars_out, double step);
+int simple_2d_orbit_bulirsch_stoer(double * vars_in, double * vars_out, double step);
 double free_2d_orbit_functions(double * vars_in, int function_ref);
 int free_2d_orbit_runge_kutta_4th(double * vars_in, double * vars_out, double step);
+int free_2d_orbit_rosenbrock_2nd(double * vars_in, double * vars_out, double step);
+int free_2d_orbit_bulirsch_stoer(double * vars_in, double * vars_out, double step);
 double free_3d_orbit_functions(double * vars_in, int function_ref);
 int free_3d_orbit_runge_kutta_4th(double * vars_in, double * vars_out, double step);
+int free_3d_orbit_rosenbrock_2nd(double * vars_in, double * vars_out, double step);
+int free_3d_orbit_bulirsch_stoer(double * vars_in, double * vars_out, double step);
+double simple_2d_orbit_radial_velocity(double * vars_in);
+double free_2d_orbit_radial_velocity(double * vars_in);
+double free_3d_orbit_radial_velocity(double * vars_in);
+sparse_matrix * orbit_jacobian_pattern(int bodies, int dimensions, int stride);
+size_t spring_network_size(int node_count, int spring_count);
+spring_network * build_spring_network(int node_count, int dimensions, double * state, int spring_count, int * spring_ends, double * stiffness, double * rest_length, double node_mass, double damping);
+void free_spring_network(spring_network * net);
+void spring_network_functions(double * vars_in, double * rates);
+int spring_network_runge_kutta_4th(double * vars_in, double * vars_out, double step);
+int spring_network_rosenbrock_2nd(double * vars_in, double * vars_out, double step);
+size_t spring_network_jacobian_pattern_size(spring_network * net);
+sparse_matrix * spring_network_jacobian_pattern(spring_network * net);